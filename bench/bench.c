@@ -0,0 +1,406 @@
+/**
+ ** This file is part of the minic project.
+ ** Copyright 2023 univrsal <uni@vrsal.xyz>.
+ ** All rights reserved.
+ **
+ ** Redistribution and use in source and binary forms, with or without
+ ** modification, are permitted provided that the following conditions are
+ ** met:
+ **
+ ** 1. Redistributions of source code must retain the above copyright notice,
+ **    this list of conditions and the following disclaimer.
+ **
+ ** 2. Redistributions in binary form must reproduce the above copyright
+ **    notice, this list of conditions and the following disclaimer in the
+ **    documentation and/or other materials provided with the distribution.
+ **
+ ** THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY
+ ** EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ ** WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ ** DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY
+ ** DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ ** (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ ** SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ ** CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ ** LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ ** OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ ** SUCH DAMAGE.
+ **/
+
+#include <mini.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/* Usage: mini_bench [--csv] [--size MB] [--ops N] [--shape name]
+ * Every result is one line, with --csv as shape,benchmark,value,unit.
+ * Peak RSS is for the whole process so far, run one shape at a time
+ * with --shape to get it per shape */
+
+#define NUMBER_COUNT 1000000
+#define BENCH_PATH "mini_bench.ini"
+#define BENCH_BINARY_PATH "mini_bench.bin"
+
+typedef struct shape_s {
+	const char *name;
+	size_t groups;    /* 0: as many as it takes to reach the file size */
+	size_t keys;      /* Per group, 0: as many as it takes             */
+	size_t value_len;
+} shape_t;
+
+static const shape_t shapes[] = {
+	{"few_groups", 16, 0, 16},
+	{"many_groups", 0, 4, 16},
+	{"long_values", 0, 8, 4096},
+};
+
+static int csv = 0;
+static size_t file_size = 128 * 1024 * 1024;
+static int ops = 1000000;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ull;
+
+static unsigned long long rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static void result(const char *shape, const char *name, double value, const char *unit)
+{
+	if (csv)
+		printf("%s,%s,%.1f,%s\n", shape, name, value, unit);
+	else
+		printf("%-12s %-28s %10.1f %s\n", shape, name, value, unit);
+	fflush(stdout);
+}
+
+static void report(const char *shape, const char *name, double start, int count)
+{
+	result(shape, name, (now_ns() - start) / count, "ns/op");
+}
+
+static void report_throughput(const char *shape, const char *name, double start, size_t bytes)
+{
+	const double seconds = (now_ns() - start) / 1e9;
+	result(shape, name, bytes / (1024.0 * 1024.0) / seconds, "MB/s");
+}
+
+/* Peak resident set size in KiB */
+static long peak_rss(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (K32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return (long)(pmc.PeakWorkingSetSize / 1024);
+	return 0;
+#else
+	long kb = 0;
+#ifdef __linux__
+	char line[256];
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+				break;
+		}
+		fclose(f);
+	}
+#endif
+	if (!kb) {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		kb = usage.ru_maxrss;
+	}
+	return kb;
+#endif
+}
+
+/* Keeps the compiler from dropping the benchmarked calls */
+static volatile size_t sink;
+
+static void bench_numbers(void)
+{
+	long long *ints = malloc(NUMBER_COUNT * sizeof(long long));
+	double *doubles = malloc(NUMBER_COUNT * sizeof(double));
+	char(*strings)[MINI_NUMBER_SIZE] = malloc(NUMBER_COUNT * MINI_NUMBER_SIZE);
+	char buf[64];
+	double start;
+	int i;
+
+	for (i = 0; i < NUMBER_COUNT; i++) {
+		ints[i] = (long long)(rng() >> (rng() % 64));
+		/* Mix of short decimals and full precision values */
+		if (i % 2)
+			doubles[i] = (double)(rng() % 1000000) / 1000.0;
+		else
+			doubles[i] = (double)(rng() >> 11) / (double)(1ull << 53) * 1e6;
+	}
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += mini_format_int(buf, ints[i]);
+	report("numbers", "format_int mini", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += snprintf(buf, sizeof(buf), "%lli", ints[i]);
+	report("numbers", "format_int snprintf", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += mini_format_double(strings[i], doubles[i]);
+	report("numbers", "format_double mini", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += snprintf(buf, sizeof(buf), "%.17g", doubles[i]);
+	report("numbers", "format_double snprintf %.17g", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += snprintf(buf, sizeof(buf), "%lf", doubles[i]);
+	report("numbers", "format_double snprintf %lf", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += mini_parse_double(strings[i], NULL) > 0;
+	report("numbers", "parse_double mini", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++)
+		sink += strtod(strings[i], NULL) > 0;
+	report("numbers", "parse_double strtod", start, NUMBER_COUNT);
+
+	start = now_ns();
+	for (i = 0; i < NUMBER_COUNT; i++) {
+		double d = 0;
+		sscanf(strings[i], "%lf", &d);
+		sink += d > 0;
+	}
+	report("numbers", "parse_double sscanf", start, NUMBER_COUNT);
+
+	free(ints);
+	free(doubles);
+	free(strings);
+}
+
+static int count_group(const char *group, size_t len, void *user)
+{
+	(void)group;
+	*(size_t *)user += len;
+	return 0;
+}
+
+static int count_value(const char *group, const char *id, size_t id_len, const char *val, size_t val_len,
+                       void *user)
+{
+	(void)group;
+	(void)id;
+	(void)val;
+	*(size_t *)user += id_len + val_len;
+	return 0;
+}
+
+/* Writes the file for a shape, fills in groups and keys, returns its size */
+static size_t write_shape(const shape_t *s, size_t *groups, size_t *keys)
+{
+	const size_t line = strlen("key000000=") + s->value_len + 1;
+	char *value = malloc(s->value_len + 1);
+	FILE *f = fopen(BENCH_PATH, "w");
+	size_t bytes = 0;
+
+	*groups = s->groups ? s->groups : file_size / (s->keys * line + strlen("[group000000]\n")) + 1;
+	*keys = s->keys ? s->keys : file_size / (s->groups * line) + 1;
+	if (!f) {
+		free(value);
+		return 0;
+	}
+
+	for (size_t g = 0; g < *groups; g++) {
+		bytes += fprintf(f, "[group%zu]\n", g);
+		for (size_t k = 0; k < *keys; k++) {
+			/* An integer for the typed gets, padded to the value length */
+			int len = snprintf(value, s->value_len + 1, "%llu", rng() % 1000000);
+			memset(value + len, 'x', s->value_len - len);
+			value[s->value_len] = '\0';
+			bytes += fprintf(f, "key%zu=%s\n", k, value);
+		}
+	}
+	fclose(f);
+	free(value);
+	return bytes;
+}
+
+static void bench_load(const char *shape, size_t bytes)
+{
+	size_t count = 0;
+	double start;
+
+	const mini_callbacks_t cb = {count_group, count_value};
+	FILE *f = fopen(BENCH_PATH, "r");
+	start = now_ns();
+	mini_parse_stream(f, &cb, &count);
+	report_throughput(shape, "parse_stream", start, bytes);
+	fclose(f);
+
+	start = now_ns();
+	mini_t *ini = mini_load(BENCH_PATH);
+	report_throughput(shape, "load", start, bytes);
+
+	start = now_ns();
+	mini_save_binary(ini, BENCH_BINARY_PATH, MINI_FLAGS_NONE);
+	report_throughput(shape, "save_binary", start, bytes);
+	mini_free(ini);
+
+	start = now_ns();
+	ini = mini_load_arena(BENCH_PATH);
+	report_throughput(shape, "load_arena", start, bytes);
+	mini_free(ini);
+
+	start = now_ns();
+	ini = mini_load_mmap(BENCH_PATH, NULL);
+	report_throughput(shape, "load_mmap", start, bytes);
+	mini_free(ini);
+
+	start = now_ns();
+	ini = mini_load_parallel(BENCH_PATH, 4, NULL);
+	report_throughput(shape, "load_parallel 4 threads", start, bytes);
+	mini_free(ini);
+
+	start = now_ns();
+	mini_snapshot_t *snap = mini_load_binary(BENCH_BINARY_PATH, NULL);
+	report_throughput(shape, "load_binary", start, bytes);
+	mini_snapshot_release(snap);
+	remove(BENCH_BINARY_PATH);
+}
+
+/* Random group/key pairs, generated up front so printing them isn't timed */
+typedef struct key_s {
+	char group[32];
+	char id[32];
+} bench_key_t;
+
+static bench_key_t *random_keys(size_t groups, size_t keys, int miss)
+{
+	bench_key_t *k = malloc(ops * sizeof(bench_key_t));
+
+	for (int i = 0; i < ops; i++) {
+		snprintf(k[i].group, sizeof(k[i].group), "group%llu", rng() % groups);
+		snprintf(k[i].id, sizeof(k[i].id), miss ? "missing%llu" : "key%llu", rng() % keys);
+	}
+	return k;
+}
+
+static void bench_ops(const char *shape, size_t bytes, size_t groups, size_t keys)
+{
+	mini_t *ini = mini_load(BENCH_PATH);
+	bench_key_t *hit = random_keys(groups, keys, 0);
+	bench_key_t *miss = random_keys(groups, keys, 1);
+	double start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		sink += (size_t)mini_get_string(ini, hit[i].group, hit[i].id, NULL);
+	report(shape, "get_string hit", start, ops);
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		sink += (size_t)mini_get_string(ini, miss[i].group, miss[i].id, NULL);
+	report(shape, "get_string miss", start, ops);
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		sink += mini_get_int(ini, hit[i].group, hit[i].id, 0);
+	report(shape, "get_int", start, ops);
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		sink += mini_get_double(ini, hit[i].group, hit[i].id, 0) > 0;
+	report(shape, "get_double", start, ops);
+
+	mini_snapshot_t *snap = mini_freeze(ini);
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		sink += (size_t)mini_snapshot_get_string(snap, hit[i].group, hit[i].id, NULL);
+	report(shape, "snapshot get_string hit", start, ops);
+	mini_snapshot_release(snap);
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		mini_set_int(ini, hit[i].group, hit[i].id, i);
+	report(shape, "set_int", start, ops);
+
+	start = now_ns();
+	char *buf;
+	size_t len;
+	mini_save_to_buffer(ini, MINI_FLAGS_NONE, &buf, &len);
+	report_throughput(shape, "save_to_buffer", start, len);
+	mini_free_buffer(buf);
+
+	start = now_ns();
+	mini_save(ini, MINI_FLAGS_FORCE);
+	report_throughput(shape, "save", start, bytes);
+
+	start = now_ns();
+	for (i = 0; i < ops; i++)
+		mini_delete_value(ini, hit[i].group, hit[i].id);
+	report(shape, "delete_value", start, ops);
+
+	mini_free(ini);
+	free(hit);
+	free(miss);
+}
+
+int main(int argc, char **argv)
+{
+	const char *only = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--csv") == 0)
+			csv = 1;
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+			file_size = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+		else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+			ops = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--shape") == 0 && i + 1 < argc)
+			only = argv[++i];
+	}
+
+	if (csv)
+		printf("shape,benchmark,value,unit\n");
+	if (!only)
+		bench_numbers();
+
+	for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+		if (only && strcmp(only, shapes[i].name) != 0)
+			continue;
+
+		size_t groups, keys;
+		const size_t bytes = write_shape(&shapes[i], &groups, &keys);
+		if (!bytes)
+			continue;
+		result(shapes[i].name, "file size", bytes / (1024.0 * 1024.0), "MB");
+		bench_load(shapes[i].name, bytes);
+		bench_ops(shapes[i].name, bytes, groups, keys);
+		result(shapes[i].name, "peak_rss", peak_rss() / 1024.0, "MB");
+		remove(BENCH_PATH);
+	}
+	return 0;
+}
@@ -28,21 +28,32 @@
  **/
 
 #include "mini.h"
-#include <malloc.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <ctype.h>
+#include <locale.h>
+#include <math.h>
+#include <stdlib.h>
 
-/* === UTF8 <-> Wchar === */
 #ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <poll.h>
+#endif
 
-static char *mini_strdup(const char *str)
-{
-	return _strdup(str);
-}
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
-#define mini_strtok strtok_s
+/* === UTF8 <-> Wchar === */
+#ifdef _WIN32
 
 wchar_t *mini_utf8_to_wide_char(const char *utf8)
 {
@@ -83,524 +94,4720 @@ int mini_set_wstring(mini_t *mini, const char *group, const char *id, const wcha
 	free(utf8);
 	return ret;
 }
+#endif
 
-#else
-static inline char *mini_strdup(const char *str)
+/* === Statistics === */
+
+/* Without MINI_ENABLE_STATS all of these compile to nothing */
+#ifdef MINI_ENABLE_STATS
+#include <time.h>
+
+static unsigned long long stats_now(void)
 {
-	return strdup(str);
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-#define mini_strtok strtok_r
+#define MINI_STAT_ADD(mini, field, n) ((mini)->stats->field += (n))
+#define MINI_STAT_SUB(mini, field, n) ((mini)->stats->field -= (n))
+#define MINI_STAT_PTR(mini, field) (&(mini)->stats->field)
+#define MINI_STAT_PROBE(probes) ((probes) ? (void)++*(probes) : (void)0)
+#define MINI_STAT_START(t) const unsigned long long t = stats_now()
+#define MINI_STAT_TIME(mini, field, t) MINI_STAT_ADD(mini, field, stats_now() - (t))
+#else
+#define MINI_STAT_ADD(mini, field, n) ((void)0)
+#define MINI_STAT_SUB(mini, field, n) ((void)0)
+#define MINI_STAT_PTR(mini, field) NULL
+#define MINI_STAT_PROBE(probes) ((void)(probes))
+#define MINI_STAT_START(t) ((void)0)
+#define MINI_STAT_TIME(mini, field, t) ((void)0)
 #endif
-/* === Utilities === */
 
-mini_value_t *make_value()
+/* === Memory === */
+
+/* Everything the library allocates goes through these, see mini_set_allocator */
+static void *default_malloc(size_t size, void *user)
 {
-	mini_value_t *val = malloc(sizeof(mini_value_t));
-	val->id = NULL;
-	val->val = NULL;
-	val->next = NULL;
-	val->prev = NULL;
-	return val;
+	(void)user;
+	return malloc(size);
 }
 
-void free_value(mini_value_t *v)
+static void *default_realloc(void *ptr, size_t size, void *user)
 {
-	if (v) {
-		free(v->id);
-		free(v->val);
-		v->id = NULL;
-		v->val = NULL;
-		v->next = NULL;
-		v->prev = NULL;
-		free(v);
-	}
+	(void)user;
+	return realloc(ptr, size);
 }
 
-mini_group_t *make_group(const char *name)
+static void default_free(void *ptr, void *user)
 {
-	mini_group_t *g = malloc(sizeof(mini_group_t));
-	memset(g, 0, sizeof(mini_group_t));
-	if (name)
-		g->id = mini_strdup(name);
-	return g;
+	(void)user;
+	free(ptr);
 }
 
-void free_group(mini_group_t *g)
+static struct {
+	mini_malloc_fn malloc_fn;
+	mini_realloc_fn realloc_fn;
+	mini_free_fn free_fn;
+	void *user;
+} allocator = {default_malloc, default_realloc, default_free, NULL};
+
+void mini_set_allocator(mini_malloc_fn malloc_fn, mini_realloc_fn realloc_fn, mini_free_fn free_fn, void *user)
 {
-	if (g) {
-		free(g->id);
-		g->next = NULL;
-		g->prev = NULL;
-		g->id = NULL;
-		g->head = NULL;
-		free(g);
+	if (malloc_fn && realloc_fn && free_fn) {
+		allocator.malloc_fn = malloc_fn;
+		allocator.realloc_fn = realloc_fn;
+		allocator.free_fn = free_fn;
+		allocator.user = user;
+	} else {
+		allocator.malloc_fn = default_malloc;
+		allocator.realloc_fn = default_realloc;
+		allocator.free_fn = default_free;
+		allocator.user = NULL;
 	}
 }
 
-void free_group_children(mini_group_t *g)
+static void *mem_alloc(size_t size)
 {
-	if (!g)
-		return;
-
-	mini_group_t *cgrp = g, *ngrp = NULL;
-	mini_value_t *cval = NULL, *nval = NULL;
+	return allocator.malloc_fn(size, allocator.user);
+}
 
-	while (cgrp) {
-		cval = cgrp->head;
-		while (cval) {
-			nval = cval->next;
-			free_value(cval);
-			cval = nval;
-		}
+static void *mem_calloc(size_t count, size_t size)
+{
+	void *ptr = mem_alloc(count * size);
+	if (ptr)
+		memset(ptr, 0, count * size);
+	return ptr;
+}
 
-		ngrp = cgrp->next;
-		free_group(cgrp);
-		cgrp = ngrp;
-	}
+static void *mem_realloc(void *ptr, size_t size)
+{
+	return allocator.realloc_fn(ptr, size, allocator.user);
 }
 
-mini_value_t *get_group_value(mini_group_t *grp, const char *id)
+static void mem_free(void *ptr)
 {
-	mini_value_t *result = grp->head;
-	while (result) {
-		if (strcmp(result->id, id) == 0)
-			return result;
-		result = result->next;
-	}
-	return NULL;
+	if (ptr)
+		allocator.free_fn(ptr, allocator.user);
 }
 
-int add_value(mini_group_t *group, const char *id, const char *val)
+static char *mini_strdup(const char *str)
 {
-	if (get_group_value(group, id))
-		return MINI_DUPLICATE_ID;
+	const size_t len = strlen(str) + 1;
+	char *result = mem_alloc(len);
+	if (result)
+		memcpy(result, str, len);
+	return result;
+}
 
-	mini_value_t *n = make_value();
-	n->id = mini_strdup(id);
-	n->val = mini_strdup(val);
-	n->next = group->head;
+/* In arena mode every node, string and table of a mini_t is carved out of
+ * large chunks. Blocks are rounded up to a size class and released blocks
+ * go onto a free list for their class, so memory given back by deletes or
+ * overwritten values is reused instead of piling up until mini_free. */
+#define MINI_ARENA_CHUNK (64 * 1024)
+#define MINI_ARENA_CLASSES 64
 
-	/* If this is the first value added to this group
-     * we set the tail pointer to this first value */
-	if (group->head == NULL)
-		group->tail = n;
-	if (group->head)
-		group->head->prev = n;
-	group->head = n;
+typedef struct mini_chunk_s {
+	struct mini_chunk_s *next;
+	size_t size;
+} mini_chunk_t;
 
-	return MINI_OK;
-}
+typedef struct mini_arena_s {
+	mini_chunk_t *chunks;
+	char *pos; /* Free space left in the newest chunk */
+	char *end;
+	size_t size; /* Of all chunks */
+	void *free[MINI_ARENA_CLASSES];
+} mini_arena_t;
 
-int parse_value(mini_group_t *group, char *line)
+/* Sizes up to 256 bytes are rounded up to multiples of 8,
+ * everything above that to the next power of two */
+static size_t arena_class(size_t size, size_t *class_size)
 {
-	char *ctx1 = NULL, *ctx2 = NULL;
-	char *id = mini_strtok(line, "=", &ctx1);
+	if (size <= 256) {
+		size_t idx = size ? (size + 7) / 8 - 1 : 0;
+		*class_size = (idx + 1) * 8;
+		return idx;
+	}
 
-	if (strlen(id) < 1)
-		return MINI_INVALID_ID;
-	if (get_group_value(group, id))
-		return MINI_DUPLICATE_ID;
+	size_t bits = 9;
+	while (((size_t)1 << bits) < size)
+		bits++;
+	*class_size = (size_t)1 << bits;
+	return 32 + bits - 9;
+}
 
-	char *val = mini_strtok(ctx1, "", &ctx2);
-	if (val && strlen(val) > 0)
-		val[strlen(val) - 1] = '\0'; /* Get rid of new line */
-	return add_value(group, id, val);
+static void *arena_chunk(mini_arena_t *a, size_t size)
+{
+	mini_chunk_t *c = mem_alloc(sizeof(mini_chunk_t) + size);
+	if (!c)
+		return NULL;
+	c->size = size;
+	c->next = a->chunks;
+	a->size += sizeof(mini_chunk_t) + size;
+	a->chunks = c;
+	return c + 1;
 }
 
-void add_group(mini_t *mini, mini_group_t *grp)
+static void *arena_alloc(mini_arena_t *a, size_t size)
 {
-	if (grp->id == NULL) { /* The root group should always be first */
-		grp->next = mini->head;
-		grp->prev = NULL;
-		if (mini->head)
-			mini->head->prev = grp;
-		mini->head = grp;
-	} else {
-		grp->next = NULL;
-		grp->prev = mini->tail;
-		if (mini->tail)
-			mini->tail->next = grp;
-		mini->tail = grp;
+	size_t class_size;
+	const size_t idx = arena_class(size, &class_size);
+
+	if (a->free[idx]) {
+		void *block = a->free[idx];
+		a->free[idx] = *(void **)block;
+		return block;
+	}
+
+	/* Big blocks get a chunk of their own */
+	if (class_size > MINI_ARENA_CHUNK / 4)
+		return arena_chunk(a, class_size);
+
+	if ((size_t)(a->end - a->pos) < class_size) {
+		a->pos = arena_chunk(a, MINI_ARENA_CHUNK);
+		if (!a->pos) {
+			a->end = NULL;
+			return NULL;
+		}
+		a->end = a->pos + MINI_ARENA_CHUNK;
 	}
+
+	void *block = a->pos;
+	a->pos += class_size;
+	return block;
 }
 
-mini_group_t *create_group(mini_t *mini, const char *name)
+static void arena_release(mini_arena_t *a, void *block, size_t size)
 {
-	mini_group_t *n = NULL;
-	n = make_group(name);
-	add_group(mini, n);
-	return n;
+	size_t class_size;
+	const size_t idx = arena_class(size, &class_size);
+	*(void **)block = a->free[idx];
+	a->free[idx] = block;
 }
 
-mini_group_t *get_group(mini_t *mini, char *id, int create)
+static void arena_destroy(mini_arena_t *a)
 {
-	if (!id)
-		return mini->head;
-
-	mini_group_t *c = mini->head->next;
-
-	/* Go over all groups on this level */
+	mini_chunk_t *c = a->chunks, *n = NULL;
 	while (c) {
-		if (strcmp(c->id, id) == 0)
-			break;
-		c = c->next;
+		n = c->next;
+		mem_free(c);
+		c = n;
 	}
+	mem_free(a);
+}
 
-	/* Didn't find any group */
-	if (!c && create)
-		return create_group(mini, id);
-	return c;
+/* All memory owned by a mini_t goes through these */
+static void *mini_alloc(mini_t *mini, size_t size)
+{
+	MINI_STAT_ADD(mini, allocations, 1);
+	if (mini->arena)
+		return arena_alloc(mini->arena, size);
+	mini->memory += size;
+	return mem_alloc(size);
 }
 
-mini_value_t *get_value(mini_t *mini, const char *group, const char *id, int *err, mini_group_t **group_ptr)
+static void mini_release(mini_t *mini, void *ptr, size_t size)
 {
-	char *tmp = NULL;
-	mini_value_t *result = NULL;
-	if (group)
-		tmp = mini_strdup(group);
-	mini_group_t *grp = get_group(mini, tmp, 0);
+	if (!ptr)
+		return;
+	MINI_STAT_SUB(mini, allocations, 1);
+	if (mini->arena) {
+		arena_release(mini->arena, ptr, size);
+	} else {
+		mini->memory -= size;
+		mem_free(ptr);
+	}
+}
 
-	if (grp) {
-		if (group_ptr)
-			*group_ptr = grp;
-		result = get_group_value(grp, id);
-		if (!result && err)
-			*err = MINI_VALUE_NOT_FOUND;
-	} else if (err) {
-		*err = MINI_GROUP_NOT_FOUND;
+static char *mini_stralloc(mini_t *mini, const char *str)
+{
+	if (!str)
+		return NULL;
+	MINI_STAT_ADD(mini, allocations, 1);
+	const size_t len = strlen(str) + 1;
+	if (!mini->arena) {
+		mini->memory += len;
+		return mini_strdup(str);
 	}
 
-	free(tmp);
+	char *result = arena_alloc(mini->arena, len);
+	if (result)
+		memcpy(result, str, len);
 	return result;
 }
 
-int write_group(const mini_group_t *g, FILE *f, int flags)
+/* Strings loaded by mini_load_mmap point into the mapping until replaced */
+static int mini_mapped(const mini_t *mini, const char *str)
 {
-	int wrote_something = 0;
-	mini_value_t *cval = g->tail;
-
-	if (cval == NULL && flags & MINI_FLAGS_SKIP_EMPTY_GROUPS)
-		return 0;
+	return mini->map && str >= mini->map && str < mini->map + mini->map_size;
+}
 
-	/* Root group doesn't have a header so it'll skip this */
-	if (g->prev) {
-		fprintf(f, "[%s]\n", g->id);
-		wrote_something = 1;
-	}
+static void mini_strfree(mini_t *mini, char *str)
+{
+	if (str && !mini_mapped(mini, str))
+		mini_release(mini, str, strlen(str) + 1);
+}
 
-	/* Write all values of this group */
-	while (cval) {
-		fprintf(f, "%s=%s\n", cval->id, cval->val);
-		cval = cval->prev;
-		wrote_something = 1;
+/* Replace a string owned by mini, reusing its block if the new
+ * string falls into the same arena size class */
+static char *mini_strreplace(mini_t *mini, char *old, const char *str)
+{
+	if (mini->arena && old && str && !mini_mapped(mini, old)) {
+		size_t old_class, new_class;
+		const size_t len = strlen(str) + 1;
+		arena_class(strlen(old) + 1, &old_class);
+		arena_class(len, &new_class);
+		if (old_class == new_class) {
+			memcpy(old, str, len);
+			return old;
+		}
 	}
-	return wrote_something;
+	mini_strfree(mini, old);
+	return mini_stralloc(mini, str);
 }
 
-/* === API implementation === */
+/* === Hash tables === */
 
-#if WIN32
-mini_t *mini_wcreate(const wchar_t *path)
+/* FNV-1a, used for both group and value ids */
+static unsigned int mini_hash(const char *str)
 {
-	mini_t *result = malloc(sizeof(mini_t));
-	if (path)
-		result->path = mini_utf8_from_wide_char(path);
-	result->head = make_group(NULL);
-	result->tail = result->head;
-	return result;
+	unsigned int h = 2166136261u;
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619u;
+	}
+	return h;
 }
 
-mini_t *mini_wtry_load_ex(const wchar_t *path, int *err)
+/* Both mini_value_t and mini_group_t start with their id */
+#define node_id(n) (*(char **)(n))
+
+/* probes counts the slots looked at with MINI_ENABLE_STATS, can be NULL */
+static void *table_lookup(const mini_table_t *t, const char *id, unsigned int hash, unsigned long long *probes)
 {
-	mini_t *result = mini_wload_ex(path, err);
+	if (!t->slots)
+		return NULL;
 
-	if (!result)
-		result = mini_wcreate(path);
-	return result;
+	size_t i = hash & t->mask;
+	while (t->slots[i].node) {
+		MINI_STAT_PROBE(probes);
+		/* Ids passed back from iteration are the node ids themselves */
+		const char *node = node_id(t->slots[i].node);
+		if (t->slots[i].hash == hash && (node == id || strcmp(node, id) == 0))
+			return t->slots[i].node;
+		i = (i + 1) & t->mask;
+	}
+	return NULL;
 }
 
-mini_t *mini_wload_ex(const wchar_t *path, int *err)
+static void *table_find(const mini_table_t *t, const char *id, unsigned int hash)
 {
-	mini_t *result = NULL;
-	struct _stat buf;
+	return table_lookup(t, id, hash, NULL);
+}
 
-	if (_wstat(path, &buf) != 0) {
-		if (err)
-			*err = MINI_FILE_NOT_FOUND;
-	} else {
-		FILE *fp = NULL;
-		_wfopen_s(&fp, path, L"r");
+/* Sorted views are kept in table->sorted once something asked for one,
+ * holding the same nodes as the table ordered by id. Adds and removes only
+ * mark them stale, the next iteration sorts again, so building a table
+ * costs the same whether it was iterated before or not */
 
-		if (fp) {
-			result = mini_loadf(fp);
-			result->path = mini_utf8_from_wide_char(path);
-			fclose(fp);
-		} else if (err) {
-			*err = MINI_ACCESS_DENIED;
-		}
+/* First position in the sorted view whose id is not below id */
+static size_t sorted_lower_bound(const mini_table_t *t, const char *id)
+{
+	size_t lo = 0, hi = t->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(node_id(t->sorted[mid]), id) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-
-	return result;
+	return lo;
 }
-#endif
 
-mini_t *mini_create(const char *path)
+static int sorted_compare(const void *a, const void *b)
 {
-	mini_t *result = malloc(sizeof(mini_t));
-	if (path)
-		result->path = mini_strdup(path);
-	result->head = make_group(NULL);
-	result->tail = result->head;
-	return result;
+	return strcmp(node_id(*(void *const *)a), node_id(*(void *const *)b));
 }
 
-mini_t *mini_try_load_ex(const char *path, int *err)
+/* Builds the sorted view on first use and after changes */
+static void sorted_build(mini_t *mini, mini_table_t *t)
 {
-	mini_t *result = mini_load_ex(path, err);
+	if (t->sorted && !t->sorted_stale)
+		return;
 
-	if (!result)
-		result = mini_create(path);
-	return result;
+	if (t->sorted_size < t->count) {
+		mini_release(mini, t->sorted, t->sorted_size * sizeof(void *));
+		t->sorted = NULL;
+	}
+	if (!t->sorted) {
+		t->sorted_size = t->count > 8 ? t->count : 8;
+		t->sorted = mini_alloc(mini, t->sorted_size * sizeof(void *));
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; t->slots && i <= t->mask; i++) {
+		if (t->slots[i].node)
+			t->sorted[n++] = t->slots[i].node;
+	}
+	qsort(t->sorted, n, sizeof(void *), sorted_compare);
+	t->sorted_stale = 0;
 }
 
-mini_t *mini_load_ex(const char *path, int *err)
+static void table_put(mini_slot_t *slots, size_t mask, void *node, unsigned int hash)
 {
-	mini_t *result = NULL;
-	struct stat buf;
+	size_t i = hash & mask;
+	while (slots[i].node)
+		i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].node = node;
+}
 
-	if (stat(path, &buf) != 0) {
-		if (err)
-			*err = MINI_FILE_NOT_FOUND;
-	} else {
-		FILE *fp = NULL;
-#if WIN32
-		fopen_s(&fp, path, "r");
-#else
-		fp = fopen(path, "r");
-#endif
+static void table_insert(mini_t *mini, mini_table_t *t, void *node, unsigned int hash)
+{
+	/* Keep the load factor below 3/4 */
+	if (!t->slots || (t->count + 1) * 4 > (t->mask + 1) * 3) {
+		size_t size = t->slots ? (t->mask + 1) * 2 : 8;
+		mini_slot_t *slots = mini_alloc(mini, size * sizeof(mini_slot_t));
+		memset(slots, 0, size * sizeof(mini_slot_t));
 
-		if (fp) {
-			result = mini_loadf(fp);
-			result->path = mini_strdup(path);
-			fclose(fp);
-		} else if (err) {
-			*err = MINI_ACCESS_DENIED;
+		if (t->slots) {
+			for (size_t i = 0; i <= t->mask; i++) {
+				if (t->slots[i].node)
+					table_put(slots, size - 1, t->slots[i].node, t->slots[i].hash);
+			}
+			mini_release(mini, t->slots, (t->mask + 1) * sizeof(mini_slot_t));
 		}
+		t->slots = slots;
+		t->mask = size - 1;
 	}
 
-	return result;
+	table_put(t->slots, t->mask, node, hash);
+	t->sorted_stale = 1;
+	t->count++;
 }
 
-mini_t *mini_loadf_ex(FILE *f, int *err)
+static void table_remove(mini_table_t *t, const void *node, unsigned int hash)
 {
-	mini_t *result = mini_create(NULL);
-	mini_group_t *current;
-	char buffer[MINI_CHUNK_SIZE];
-
-	current = result->head;
+	if (!t->slots)
+		return;
 
-	while (fgets(buffer, sizeof(buffer), f)) {
-		buffer[MINI_CHUNK_SIZE - 1] = '\0';
+	size_t i = hash & t->mask;
+	while (t->slots[i].node != node) {
+		if (!t->slots[i].node)
+			return;
+		i = (i + 1) & t->mask;
+	}
 
-		if (strlen(buffer) < 1 || buffer[0] == '\n') {
-			continue;
-		} else if (buffer[0] == '[') {
-			/* Group header */
-			buffer[strlen(buffer) - 2] = '\0';                  /* Remove ']\n' */
-			mini_group_t *n = get_group(result, buffer + 1, 1); /* Skip '[' */
-
-			if (n)
-				current = n;
-			else if (err)
-				*err |= MINI_INVALID_GROUP;
-		} else {
-			parse_value(current, buffer);
+	/* Backward shift deletion, move up every following entry
+	 * that would be unreachable with slot i empty */
+	size_t j = i;
+	for (;;) {
+		j = (j + 1) & t->mask;
+		if (!t->slots[j].node)
+			break;
+		size_t home = t->slots[j].hash & t->mask;
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			t->slots[i] = t->slots[j];
+			i = j;
 		}
 	}
-
-	return result;
+	t->slots[i].node = NULL;
+	t->sorted_stale = 1;
+	t->count--;
 }
 
-int mini_save(const mini_t *mini, int flags)
+static void table_free(mini_t *mini, mini_table_t *t)
 {
-	int result = MINI_OK;
+	if (t->slots)
+		mini_release(mini, t->slots, (t->mask + 1) * sizeof(mini_slot_t));
+	if (t->sorted)
+		mini_release(mini, t->sorted, t->sorted_size * sizeof(void *));
+	t->slots = NULL;
+	t->mask = 0;
+	t->count = 0;
+	t->sorted = NULL;
+	t->sorted_size = 0;
+	t->sorted_stale = 0;
+}
 
-	if (!mini->path || strlen(mini->path) < 1) {
-		result = MINI_INVALID_PATH;
-	} else {
-		FILE *fp = NULL;
-#if WIN32
-		_wfopen_s(&fp, mini_utf8_to_wide_char(mini->path), L"w");
-#else
-		fp = fopen(mini->path, "w");
-#endif
+/* Value ids are interned: all values with the same id point to the string
+ * of one reference counted atom, which is stored right behind the atom */
+typedef struct mini_atom_s {
+	char *id;
+	size_t refs;
+} mini_atom_t;
 
-		if (fp) {
-			result = mini_savef(mini, fp, flags);
-			fclose(fp);
-		} else {
-			result = MINI_ACCESS_DENIED;
-		}
+static char *mini_intern(mini_t *mini, const char *id, unsigned int hash)
+{
+	mini_atom_t *a = table_find(&mini->atoms, id, hash);
+	if (!a) {
+		const size_t len = strlen(id) + 1;
+		a = mini_alloc(mini, sizeof(mini_atom_t) + len);
+		a->id = (char *)(a + 1);
+		a->refs = 0;
+		memcpy(a->id, id, len);
+		table_insert(mini, &mini->atoms, a, hash);
 	}
-
-	return result;
+	a->refs++;
+	return a->id;
 }
 
-int mini_savef(const mini_t *mini, FILE *f, int flags)
+static void mini_unintern(mini_t *mini, char *id)
 {
-	if (!f)
-		return MINI_INVALID_ARG;
-
-	mini_group_t *grp = mini->head;
+	if (!id || mini_mapped(mini, id))
+		return;
 
-	while (grp) {
-		int wrote_something = write_group(grp, f, flags);
-		grp = grp->next;
-		/* Unless this is the last group, add an empty line
-         * to separate groups */
-		if (grp && wrote_something)
-			fprintf(f, "\n");
+	mini_atom_t *a = (mini_atom_t *)id - 1;
+	if (--a->refs == 0) {
+		const size_t len = strlen(id) + 1;
+		table_remove(&mini->atoms, a, mini_hash(id));
+		mini_release(mini, a, sizeof(mini_atom_t) + len);
 	}
-	return MINI_OK;
 }
 
-void mini_free(mini_t *mini)
+/* === Numbers === */
+
+/* Locale independent number conversions. Doubles are written with the
+ * Grisu2 algorithm (Florian Loitsch, "Printing Floating-Point Numbers
+ * Quickly and Accurately with Integers"), whose output always reads back
+ * to the same double and is the shortest such string in nearly all cases */
+
+static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+                                  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+                                  "8081828384858687888990919293949596979899";
+
+static int format_uint(char *buf, unsigned long long val)
 {
-	if (mini) {
-		free(mini->path);
-		free_group_children(mini->head);
-		mini->path = NULL;
-		mini->tail = NULL;
-		free(mini);
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+
+	while (val >= 100) {
+		const unsigned int i = (unsigned int)(val % 100) * 2;
+		val /= 100;
+		*--p = digit_pairs[i + 1];
+		*--p = digit_pairs[i];
+	}
+	if (val >= 10) {
+		*--p = digit_pairs[val * 2 + 1];
+		*--p = digit_pairs[val * 2];
+	} else {
+		*--p = (char)('0' + val);
 	}
+
+	const int len = (int)(tmp + sizeof(tmp) - p);
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return len;
+}
+
+int mini_format_int(char *buf, long long val)
+{
+	if (val < 0) {
+		*buf = '-';
+		return 1 + format_uint(buf + 1, 0ull - (unsigned long long)val);
+	}
+	return format_uint(buf, val);
+}
+
+/* Floating point number with 64 bit significand, f * 2^e */
+typedef struct {
+	unsigned long long f;
+	int e;
+} diy_fp;
+
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFull
+#define DP_HIDDEN_BIT 0x0010000000000000ull
+
+/* 10^k for k = -348, -340, ..., 340 */
+static const unsigned long long cached_powers_f[] = {
+	0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull, 0xcf42894a5dce35eaull,
+	0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull, 0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full,
+	0xbe5691ef416bd60cull, 0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+	0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull, 0xc21094364dfb5637ull,
+	0x9096ea6f3848984full, 0xd77485cb25823ac7ull, 0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull,
+	0xb23867fb2a35b28eull, 0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+	0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull, 0xb5b5ada8aaff80b8ull,
+	0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull, 0x964e858c91ba2655ull, 0xdff9772470297ebdull,
+	0xa6dfbd9fb8e5b88full, 0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+	0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull, 0xaa242499697392d3ull,
+	0xfd87b5f28300ca0eull, 0xbce5086492111aebull, 0x8cbccc096f5088ccull, 0xd1b71758e219652cull,
+	0x9c40000000000000ull, 0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+	0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull, 0x9f4f2726179a2245ull,
+	0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull, 0x83c7088e1aab65dbull, 0xc45d1df942711d9aull,
+	0x924d692ca61be758ull, 0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+	0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull, 0x952ab45cfa97a0b3ull,
+	0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull, 0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull,
+	0x88fcf317f22241e2ull, 0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+	0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull, 0x8bab8eefb6409c1aull,
+	0xd01fef10a657842cull, 0x9b10a4e5e9913129ull, 0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull,
+	0x80444b5e7aa7cf85ull, 0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+	0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull
+};
+
+static const short cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927, -901, -874, -847,
+	-821, -794, -768, -741, -715, -688, -661, -635, -608, -582, -555, -529, -502, -475, -449, -422,
+	-396, -369, -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+	83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508, 534, 561, 588,
+	614, 641, 667, 694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const unsigned int pow10_32[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+static const unsigned long long pow10_64[] = {1ull,
+                                              10ull,
+                                              100ull,
+                                              1000ull,
+                                              10000ull,
+                                              100000ull,
+                                              1000000ull,
+                                              10000000ull,
+                                              100000000ull,
+                                              1000000000ull,
+                                              10000000000ull,
+                                              100000000000ull,
+                                              1000000000000ull,
+                                              10000000000000ull,
+                                              100000000000000ull,
+                                              1000000000000000ull,
+                                              10000000000000000ull,
+                                              100000000000000000ull,
+                                              1000000000000000000ull,
+                                              10000000000000000000ull};
+
+static diy_fp diy_fp_multiply(diy_fp x, diy_fp y)
+{
+	const unsigned long long m32 = 0xFFFFFFFFull;
+	const unsigned long long a = x.f >> 32, b = x.f & m32;
+	const unsigned long long c = y.f >> 32, d = y.f & m32;
+	const unsigned long long ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	unsigned long long tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+	tmp += 1ull << 31; /* Round */
+
+	diy_fp r = {ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64};
+	return r;
+}
+
+static diy_fp diy_fp_normalize(diy_fp x)
+{
+	while (!(x.f & 0x8000000000000000ull)) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+static void grisu_round(char *buf, int len, unsigned long long delta, unsigned long long rest,
+                        unsigned long long ten_kappa, unsigned long long wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static int count_digits(unsigned int n)
+{
+	int digits = 1;
+	while (digits < 10 && n >= pow10_32[digits])
+		digits++;
+	return digits;
+}
+
+static void digit_gen(diy_fp w, diy_fp mp, unsigned long long delta, char *buf, int *len, int *k)
+{
+	const diy_fp one = {1ull << -mp.e, mp.e};
+	const unsigned long long wp_w = mp.f - w.f;
+	unsigned int p1 = (unsigned int)(mp.f >> -one.e);
+	unsigned long long p2 = mp.f & (one.f - 1);
+	int kappa = count_digits(p1);
+
+	*len = 0;
+	while (kappa > 0) {
+		const unsigned int d = p1 / pow10_32[kappa - 1];
+		p1 %= pow10_32[kappa - 1];
+		if (d || *len)
+			buf[(*len)++] = (char)('0' + d);
+		kappa--;
+
+		const unsigned long long tmp = ((unsigned long long)p1 << -one.e) + p2;
+		if (tmp <= delta) {
+			*k += kappa;
+			grisu_round(buf, *len, delta, tmp, (unsigned long long)pow10_32[kappa] << -one.e, wp_w);
+			return;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		const char d = (char)(p2 >> -one.e);
+		if (d || *len)
+			buf[(*len)++] = (char)('0' + d);
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			grisu_round(buf, *len, delta, p2, one.f, -kappa < 20 ? wp_w * pow10_64[-kappa] : 0);
+			return;
+		}
+	}
+}
+
+/* Writes the shortest digits of a positive finite value, value = buf * 10^k */
+static int grisu2(double value, char *buf, int *k)
+{
+	unsigned long long bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	const int biased_e = (int)((bits >> 52) & 0x7FF);
+	diy_fp v;
+	v.f = bits & DP_SIGNIFICAND_MASK;
+	if (biased_e) {
+		v.f += DP_HIDDEN_BIT;
+		v.e = biased_e - 1075;
+	} else {
+		v.e = -1074;
+	}
+
+	/* Boundaries halfway to the neighbouring doubles */
+	diy_fp plus = {(v.f << 1) + 1, v.e - 1};
+	while (!(plus.f & (DP_HIDDEN_BIT << 1))) {
+		plus.f <<= 1;
+		plus.e--;
+	}
+	plus.f <<= 10;
+	plus.e -= 10;
+
+	diy_fp minus;
+	if (v.f == DP_HIDDEN_BIT) {
+		minus.f = (v.f << 2) - 1;
+		minus.e = v.e - 2;
+	} else {
+		minus.f = (v.f << 1) - 1;
+		minus.e = v.e - 1;
+	}
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	/* Pick a cached power of ten which brings the exponent into [-60, -32] */
+	const double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (dk - ik > 0.0)
+		ik++;
+	const unsigned int index = (unsigned int)((ik >> 3) + 1);
+	const diy_fp c_mk = {cached_powers_f[index], cached_powers_e[index]};
+	*k = -(-348 + (int)index * 8);
+
+	const diy_fp w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+	diy_fp wp = diy_fp_multiply(plus, c_mk);
+	diy_fp wm = diy_fp_multiply(minus, c_mk);
+	wm.f++;
+	wp.f--;
+
+	int len;
+	digit_gen(w, wp, wp.f - wm.f, buf, &len, k);
+	return len;
+}
+
+static int write_exponent(char *buf, int k)
+{
+	char *p = buf;
+	if (k < 0) {
+		*p++ = '-';
+		k = -k;
+	}
+	return (int)(p - buf) + format_uint(p, (unsigned long long)k);
+}
+
+/* Turns digits * 10^k into plain or exponent notation */
+static int prettify(char *buf, int len, int k)
+{
+	const int kk = len + k; /* 10^(kk - 1) <= v < 10^kk */
+
+	if (k >= 0 && kk <= 21) {
+		/* 1234e7 -> 12340000000.0 */
+		memset(buf + len, '0', k);
+		buf[kk] = '.';
+		buf[kk + 1] = '0';
+		buf[kk + 2] = '\0';
+		return kk + 2;
+	} else if (kk > 0 && kk <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memmove(buf + kk + 1, buf + kk, len - kk);
+		buf[kk] = '.';
+		buf[len + 1] = '\0';
+		return len + 1;
+	} else if (kk > -6 && kk <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		const int offset = 2 - kk;
+		memmove(buf + offset, buf, len);
+		buf[0] = '0';
+		buf[1] = '.';
+		memset(buf + 2, '0', offset - 2);
+		buf[len + offset] = '\0';
+		return len + offset;
+	} else if (len == 1) {
+		/* 1e30 */
+		buf[1] = 'e';
+		return 2 + write_exponent(buf + 2, kk - 1);
+	}
+
+	/* 1234e30 -> 1.234e33 */
+	memmove(buf + 2, buf + 1, len - 1);
+	buf[1] = '.';
+	buf[len + 1] = 'e';
+	return len + 2 + write_exponent(buf + len + 2, kk - 1);
+}
+
+int mini_format_double(char *buf, double val)
+{
+	char *p = buf;
+
+	if (val != val) {
+		memcpy(buf, "nan", 4);
+		return 3;
+	}
+
+	if (signbit(val)) {
+		*p++ = '-';
+		val = -val;
+	}
+
+	if (val == 0) {
+		memcpy(p, "0.0", 4);
+	} else if (isinf(val)) {
+		memcpy(p, "inf", 4);
+	} else {
+		int k;
+		const int len = grisu2(val, p, &k);
+		return (int)(p - buf) + prettify(p, len, k);
+	}
+	return (int)(p - buf) + 3;
+}
+
+/* Exactly representable powers of ten */
+static const double pow10_exact[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static int match_word(const char *str, const char *word)
+{
+	while (*word) {
+		if (tolower((unsigned char)*str++) != *word++)
+			return 0;
+	}
+	return 1;
+}
+
+/* Reparses a number which can't be converted exactly with one operation.
+ * strtod does this correctly but expects the locale's decimal point */
+static double parse_double_slow(const char *start, const char *end)
+{
+	char tmp[64], *copy = tmp;
+	const size_t len = end - start;
+	const char point = localeconv()->decimal_point[0];
+
+	if (len >= sizeof(tmp))
+		copy = mem_alloc(len + 1);
+	memcpy(copy, start, len);
+	copy[len] = '\0';
+
+	for (char *p = copy; *p; p++) {
+		if (*p == '.')
+			*p = point;
+	}
+
+	const double result = strtod(copy, NULL);
+	if (copy != tmp)
+		mem_free(copy);
+	return result;
+}
+
+double mini_parse_double(const char *str, char **end)
+{
+	const char *p = str;
+	int negative = 0;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	const char *start = p;
+
+	if (*p == '-' || *p == '+')
+		negative = *p++ == '-';
+
+	if (match_word(p, "inf") || match_word(p, "nan")) {
+		const int inf = tolower((unsigned char)*p) == 'i';
+		p += inf && match_word(p, "infinity") ? 8 : 3;
+		if (end)
+			*end = (char *)p;
+		if (inf)
+			return negative ? -HUGE_VAL : HUGE_VAL;
+		return negative ? -NAN : NAN;
+	}
+
+	/* Hex numbers are rare enough to leave them to strtod */
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && (isxdigit((unsigned char)p[2]) || p[2] == '.')) {
+		for (p += 2; isxdigit((unsigned char)*p); p++)
+			;
+		if (*p == '.') {
+			for (p++; isxdigit((unsigned char)*p); p++)
+				;
+		}
+		if ((*p == 'p' || *p == 'P') && (isdigit((unsigned char)p[1]) ||
+		                                 ((p[1] == '-' || p[1] == '+') && isdigit((unsigned char)p[2])))) {
+			for (p += 2; isdigit((unsigned char)*p); p++)
+				;
+		}
+		if (end)
+			*end = (char *)p;
+		return parse_double_slow(start, p);
+	}
+
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0, exact = 1;
+	const char *digits_start = p;
+
+	for (; isdigit((unsigned char)*p); p++) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits += mantissa > 0;
+		} else {
+			exponent++;
+			exact &= *p == '0';
+		}
+	}
+
+	if (*p == '.') {
+		for (p++; isdigit((unsigned char)*p); p++) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa > 0;
+				exponent--;
+			} else {
+				exact &= *p == '0';
+			}
+		}
+	}
+
+	if (p == digits_start || (p == digits_start + 1 && *digits_start == '.')) {
+		/* Not a number */
+		if (end)
+			*end = (char *)str;
+		return 0;
+	}
+
+	if (*p == 'e' || *p == 'E') {
+		const char *e = p + 1;
+		int exp_negative = 0, exp = 0;
+
+		if (*e == '-' || *e == '+')
+			exp_negative = *e++ == '-';
+		if (isdigit((unsigned char)*e)) {
+			for (; isdigit((unsigned char)*e); e++) {
+				if (exp < 100000)
+					exp = exp * 10 + (*e - '0');
+			}
+			exponent += exp_negative ? -exp : exp;
+			p = e;
+		}
+	}
+
+	if (end)
+		*end = (char *)p;
+
+	/* Clinger's fast path, mantissa and power of ten are both exact
+	 * so the result of a single multiplication or division is too */
+	double result;
+	if (!exact || mantissa > (1ull << 53) || exponent < -22 || exponent > 22 + 15) {
+		if (mantissa == 0 && exact)
+			result = 0;
+		else
+			return parse_double_slow(start, p);
+	} else if (exponent < 0) {
+		result = (double)mantissa / pow10_exact[-exponent];
+	} else if (exponent <= 22) {
+		result = (double)mantissa * pow10_exact[exponent];
+	} else {
+		/* Move some of the exponent into the mantissa if that stays exact */
+		const double m = (double)mantissa * pow10_exact[exponent - 22];
+		if (m >= 9007199254740992.0)
+			return parse_double_slow(start, p);
+		result = m * pow10_exact[22];
+	}
+	return negative ? -result : result;
+}
+
+/* === Utilities === */
+
+/* Nothing changed since mini->path was last loaded or saved */
+static int mini_synced(const mini_t *mini)
+{
+	return !mini->dirty && mini->path && mini->synced_path && strcmp(mini->path, mini->synced_path) == 0;
+}
+
+/* Flags for mini_value_t.cached */
+#define MINI_CACHED_INT (1 << 0)
+#define MINI_CACHED_RANGE_ERROR (1 << 1)
+#define MINI_CACHED_DOUBLE (1 << 2)
+
+mini_value_t *make_value(mini_t *mini)
+{
+	mini_value_t *val = mini_alloc(mini, sizeof(mini_value_t));
+	val->id = NULL;
+	val->val = NULL;
+	val->next = NULL;
+	val->prev = NULL;
+	val->cached = 0;
+	return val;
+}
+
+/* Header of the block holding the values of a packed group */
+typedef struct mini_block_s {
+	size_t size; /* Including the nodes and strings      */
+	size_t live; /* Nodes in the block not yet deleted   */
+} mini_block_t;
+
+/* Nodes and strings in the block can't be released on their own */
+static int block_owns(const mini_group_t *grp, const void *ptr)
+{
+	const char *start = (const char *)grp->block;
+	return start && (const char *)ptr >= start && (const char *)ptr < start + grp->block->size;
+}
+
+void free_value(mini_t *mini, mini_group_t *grp, mini_value_t *v)
+{
+	if (v) {
+		const int packed = block_owns(grp, v);
+		mini_unintern(mini, v->id);
+		if (!block_owns(grp, v->val))
+			mini_strfree(mini, v->val);
+		v->id = NULL;
+		v->val = NULL;
+		v->next = NULL;
+		v->prev = NULL;
+
+		if (!packed) {
+			mini_release(mini, v, sizeof(mini_value_t));
+		} else if (--grp->block->live == 0) {
+			mini_release(mini, grp->block, grp->block->size);
+			grp->block = NULL;
+		}
+	}
+}
+
+mini_group_t *make_group(mini_t *mini, const char *name)
+{
+	mini_group_t *g = mini_alloc(mini, sizeof(mini_group_t));
+	memset(g, 0, sizeof(mini_group_t));
+	if (name)
+		g->id = mini_stralloc(mini, name);
+	return g;
+}
+
+void free_group(mini_t *mini, mini_group_t *g)
+{
+	if (g) {
+		mini_value_t *cval = g->head, *nval = NULL;
+		while (cval) {
+			nval = cval->next;
+			free_value(mini, g, cval);
+			cval = nval;
+		}
+
+		table_free(mini, &g->values);
+		mini_strfree(mini, g->id);
+		g->next = NULL;
+		g->prev = NULL;
+		g->id = NULL;
+		g->head = NULL;
+		g->tail = NULL;
+		mini_release(mini, g, sizeof(mini_group_t));
+	}
+}
+
+void free_group_children(mini_t *mini, mini_group_t *g)
+{
+	mini_group_t *ngrp = NULL;
+
+	while (g) {
+		ngrp = g->next;
+		free_group(mini, g);
+		g = ngrp;
+	}
+}
+
+mini_value_t *get_group_value(mini_group_t *grp, const char *id)
+{
+	return table_find(&grp->values, id, mini_hash(id));
+}
+
+/* Makes n the newest value of group */
+static void attach_value(mini_t *mini, mini_group_t *group, mini_value_t *n, unsigned int hash)
+{
+	n->prev = NULL;
+	n->next = group->head;
+	table_insert(mini, &group->values, n, hash);
+
+	/* If this is the first value added to this group
+     * we set the tail pointer to this first value */
+	if (group->head == NULL)
+		group->tail = n;
+	if (group->head)
+		group->head->prev = n;
+	group->head = n;
+	mini->generation++;
+	mini->dirty = 1;
+}
+
+/* Takes ownership of id and val */
+static void link_value(mini_t *mini, mini_group_t *group, char *id, char *val, unsigned int hash)
+{
+	mini_value_t *n = make_value(mini);
+	n->id = id;
+	n->val = val;
+	attach_value(mini, group, n, hash);
+}
+
+int add_value(mini_t *mini, mini_group_t *group, const char *id, const char *val)
+{
+	const unsigned int hash = mini_hash(id);
+	if (table_find(&group->values, id, hash))
+		return MINI_DUPLICATE_ID;
+
+	link_value(mini, group, mini_intern(mini, id, hash), mini_stralloc(mini, val), hash);
+	return MINI_OK;
+}
+
+void add_group(mini_t *mini, mini_group_t *grp)
+{
+	if (grp->id == NULL) { /* The root group should always be first */
+		grp->next = mini->head;
+		grp->prev = NULL;
+		if (mini->head)
+			mini->head->prev = grp;
+		mini->head = grp;
+	} else {
+		grp->next = NULL;
+		grp->prev = mini->tail;
+		if (mini->tail)
+			mini->tail->next = grp;
+		mini->tail = grp;
+		table_insert(mini, &mini->groups, grp, mini_hash(grp->id));
+	}
+	mini->generation++;
+	mini->dirty = 1;
+}
+
+mini_group_t *create_group(mini_t *mini, const char *name)
+{
+	mini_group_t *n = NULL;
+	n = make_group(mini, name);
+	add_group(mini, n);
+	return n;
+}
+
+mini_group_t *get_group(mini_t *mini, const char *id, int create)
+{
+	if (!id)
+		return mini->head;
+
+	mini_group_t *c = table_lookup(&mini->groups, id, mini_hash(id), MINI_STAT_PTR(mini, group_probes));
+
+	/* Didn't find any group */
+	if (!c && create)
+		return create_group(mini, id);
+	return c;
+}
+
+mini_value_t *get_value(mini_t *mini, const char *group, const char *id, int *err, mini_group_t **group_ptr)
+{
+	mini_value_t *result = NULL;
+	mini_group_t *grp = get_group(mini, group, 0);
+
+	MINI_STAT_ADD(mini, lookups, 1);
+	if (grp) {
+		if (group_ptr)
+			*group_ptr = grp;
+		result = table_lookup(&grp->values, id, mini_hash(id), MINI_STAT_PTR(mini, value_probes));
+		if (result)
+			MINI_STAT_ADD(mini, hits, 1);
+		else
+			MINI_STAT_ADD(mini, value_misses, 1);
+		if (!result && err)
+			*err = MINI_VALUE_NOT_FOUND;
+	} else {
+		MINI_STAT_ADD(mini, group_misses, 1);
+		if (err)
+			*err = MINI_GROUP_NOT_FOUND;
+	}
+
+	return result;
+}
+
+/* === Scanner === */
+
+/* Finds the next occurrence of a character, like memchr.
+ * The parser spends most of its time here looking for '\n' and '=',
+ * so there are SSE2 and AVX2 versions picked at runtime */
+typedef char *(*scan_fn)(char *p, const char *end, char c);
+
+static char *scan_scalar(char *p, const char *end, char c)
+{
+	/* Eight bytes at a time, a byte equal to c turns zero after the xor */
+	const unsigned long long ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+	const unsigned long long pattern = ones * (unsigned char)c;
+
+	while (end - p >= 8) {
+		unsigned long long w;
+		memcpy(&w, p, sizeof(w));
+		w ^= pattern;
+		if ((w - ones) & ~w & highs)
+			break;
+		p += 8;
+	}
+
+	for (; p < end; p++) {
+		if (*p == c)
+			return p;
+	}
+	return NULL;
+}
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define MINI_SIMD_X86
+#include <immintrin.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MINI_TARGET_AVX2
+
+static int mini_ctz(unsigned int x)
+{
+	unsigned long idx;
+	_BitScanForward(&idx, x);
+	return (int)idx;
+}
+#else
+#define MINI_TARGET_AVX2 __attribute__((target("avx2")))
+#define mini_ctz __builtin_ctz
+#endif
+
+static char *scan_sse2(char *p, const char *end, char c)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+
+	while (end - p >= 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return p + mini_ctz(mask);
+		p += 16;
+	}
+	return scan_scalar(p, end, c);
+}
+
+MINI_TARGET_AVX2 static char *scan_avx2(char *p, const char *end, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+
+	while (end - p >= 32) {
+		const __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+		const unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+		if (mask)
+			return p + mini_ctz(mask);
+		p += 32;
+	}
+	return scan_sse2(p, end, c);
+}
+
+static int cpu_has_avx2(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
+	__cpuid(info, 1);
+	/* OSXSAVE and AVX, then check that the OS saves the ymm registers */
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static char *scan_detect(char *p, const char *end, char c);
+static scan_fn scan_impl = scan_detect;
+
+/* The first parses may run on several threads at once. They all store the
+ * same function, so relaxed atomics are enough to make that well defined */
+#if defined(_MSC_VER) && !defined(__clang__)
+#define scan_load() (*(scan_fn volatile *)&scan_impl)
+#define scan_store(fn) (*(scan_fn volatile *)&scan_impl = (fn))
+#else
+#define scan_load() __atomic_load_n(&scan_impl, __ATOMIC_RELAXED)
+#define scan_store(fn) __atomic_store_n(&scan_impl, (fn), __ATOMIC_RELAXED)
+#endif
+
+static char *scan_char(char *p, const char *end, char c)
+{
+	return scan_load()(p, end, c);
+}
+
+/* Resolves scan_impl on first use */
+static char *scan_detect(char *p, const char *end, char c)
+{
+#ifdef MINI_SIMD_X86
+	scan_store(cpu_has_avx2() ? scan_avx2 : scan_sse2);
+#else
+	scan_store(scan_scalar);
+#endif
+	return scan_load()(p, end, c);
+}
+
+/* === Parser === */
+
+typedef struct parser_s {
+	const mini_callbacks_t *cb;
+	void *user;
+	char *group; /* Copy of the current group name, NULL for the root group */
+	size_t group_size;
+	char *line; /* Copy of the current line for read only buffers */
+	size_t line_size;
+} parser_t;
+
+static void parser_free(parser_t *p)
+{
+	mem_free(p->group);
+	mem_free(p->line);
+	p->group = NULL;
+	p->line = NULL;
+}
+
+/* Handles one line, which has to be null terminated and may still contain
+ * the line ending. Group headers and values are terminated in place.
+ * Returns non-zero if a callback asked to stop */
+static int parse_line(parser_t *p, char *line, size_t len)
+{
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		line[--len] = '\0';
+
+	if (len < 1)
+		return 0;
+
+	if (line[0] == '[') {
+		/* Group header, skip '[' and drop ']' */
+		if (line[len - 1] == ']')
+			line[--len] = '\0';
+		line++;
+		len--;
+
+		if (len + 1 > p->group_size) {
+			mem_free(p->group);
+			p->group_size = len + 1 > 64 ? len + 1 : 64;
+			p->group = mem_alloc(p->group_size);
+		}
+		memcpy(p->group, line, len + 1);
+		return p->cb->on_group ? p->cb->on_group(line, len, p->user) : 0;
+	}
+
+	/* Value, "id=val" */
+	char *val = scan_char(line, line + len, '=');
+	if (!val || val == line)
+		return 0;
+	*val++ = '\0';
+
+	if (!p->cb->on_value)
+		return 0;
+	return p->cb->on_value(p->group, line, val - line - 1, val, line + len - val, p->user);
+}
+
+int mini_parse_stream(FILE *f, const mini_callbacks_t *cb, void *user)
+{
+	if (!f || !cb)
+		return MINI_INVALID_ARG;
+
+	parser_t p = {cb, user, NULL, 0, NULL, 0};
+	size_t size = MINI_CHUNK_SIZE;
+	char *buffer = mem_alloc(size + 1); /* Space for a terminator */
+	size_t have = 0;
+	int result = MINI_OK;
+
+	/* Reads whole chunks and splits them into lines, a line which
+	 * doesn't end in the current chunk is moved to the front */
+	while (result == MINI_OK) {
+		/* The line fills the whole buffer, double it so lines of any
+		 * length stay in one piece with amortized linear copying */
+		if (have == size) {
+			char *grown = mem_realloc(buffer, size * 2 + 1);
+			if (!grown) {
+				result = MINI_OUT_OF_MEMORY;
+				break;
+			}
+			buffer = grown;
+			size *= 2;
+		}
+
+		const size_t n = fread(buffer + have, 1, size - have, f);
+		char *pos = buffer, *end = buffer + have + n, *nl;
+
+		/* The carried over part is known to have no line break */
+		char *scan = buffer + have;
+		while ((nl = scan_char(scan, end, '\n'))) {
+			*nl = '\0';
+			if (parse_line(&p, pos, nl - pos)) {
+				result = MINI_ABORTED;
+				break;
+			}
+			pos = nl + 1;
+			scan = pos;
+		}
+
+		have = end - pos;
+		if (result != MINI_OK)
+			break;
+
+		if (n == 0) {
+			/* Last line without a line break */
+			if (have) {
+				pos[have] = '\0';
+				if (parse_line(&p, pos, have))
+					result = MINI_ABORTED;
+			}
+			break;
+		}
+		memmove(buffer, pos, have);
+	}
+
+	if (result == MINI_OK && ferror(f))
+		result = MINI_READ_ERROR;
+	mem_free(buffer);
+	parser_free(&p);
+	return result;
+}
+
+/* Callbacks which build a mini_t from the parsed lines */
+typedef struct tree_builder_s {
+	mini_t *mini;
+	mini_group_t *current;
+	int *err;
+} tree_builder_t;
+
+static int build_group(const char *group, size_t len, void *user)
+{
+	tree_builder_t *b = user;
+	mini_group_t *n = get_group(b->mini, group, 1);
+	(void)len;
+
+	if (n)
+		b->current = n;
+	else if (b->err)
+		*b->err |= MINI_INVALID_GROUP;
+	return 0;
+}
+
+static int build_value(const char *group, const char *id, size_t id_len, const char *val, size_t val_len, void *user)
+{
+	tree_builder_t *b = user;
+	(void)group;
+	(void)id_len;
+	(void)val_len;
+
+	/* Lines in a file mapping are writable and can be referenced as they are */
+	if (mini_mapped(b->mini, id)) {
+		const unsigned int hash = mini_hash(id);
+		if (!table_find(&b->current->values, id, hash))
+			link_value(b->mini, b->current, (char *)id, (char *)val, hash);
+	} else {
+		add_value(b->mini, b->current, id, val);
+	}
+	return 0;
+}
+
+static const mini_callbacks_t tree_callbacks = {build_group, build_value};
+
+/* === Serializer === */
+
+/* Growable output buffer, always null terminated */
+typedef struct out_buffer_s {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed; /* Set once an allocation failed, appends do nothing after that */
+} out_buffer_t;
+
+static void buffer_append(out_buffer_t *b, const char *str, size_t len)
+{
+	if (b->failed)
+		return;
+
+	if (b->len + len + 1 > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		while (b->len + len + 1 > size)
+			size *= 2;
+
+		char *data = mem_realloc(b->data, size);
+		if (!data) {
+			b->failed = 1;
+			return;
+		}
+		b->data = data;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, str, len);
+	b->len += len;
+	b->data[b->len] = '\0';
+}
+
+static void buffer_append_str(out_buffer_t *b, const char *str)
+{
+	if (str)
+		buffer_append(b, str, strlen(str));
+}
+
+static int write_group(const mini_group_t *g, out_buffer_t *b, int flags)
+{
+	int wrote_something = 0;
+	mini_value_t *cval = g->tail;
+
+	if (cval == NULL && flags & MINI_FLAGS_SKIP_EMPTY_GROUPS)
+		return 0;
+
+	/* Root group doesn't have a header so it'll skip this */
+	if (g->prev) {
+		buffer_append(b, "[", 1);
+		buffer_append_str(b, g->id);
+		buffer_append(b, "]\n", 2);
+		wrote_something = 1;
+	}
+
+	/* Write all values of this group */
+	while (cval) {
+		buffer_append_str(b, cval->id);
+		buffer_append(b, "=", 1);
+		buffer_append_str(b, cval->val);
+		buffer_append(b, "\n", 1);
+		cval = cval->prev;
+		wrote_something = 1;
+	}
+	return wrote_something;
+}
+
+static int serialize(const mini_t *mini, int flags, out_buffer_t *b)
+{
+	mini_group_t *grp = mini->head;
+
+	/* Make sure there's a buffer even if nothing is written */
+	buffer_append(b, "", 0);
+
+	while (grp) {
+		int wrote_something = write_group(grp, b, flags);
+		grp = grp->next;
+		/* Unless this is the last group, add an empty line
+		 * to separate groups */
+		if (grp && wrote_something)
+			buffer_append(b, "\n", 1);
+	}
+
+	if (b->failed) {
+		mem_free(b->data);
+		memset(b, 0, sizeof(out_buffer_t));
+		return MINI_OUT_OF_MEMORY;
+	}
+	return MINI_OK;
+}
+
+/* === Journal === */
+
+/* Each record is [payload length][checksum of the payload][payload], both
+ * 32 bit little endian. The payload is the operation, whether a group name
+ * follows and then the null terminated group, id and value as needed.
+ * Replay stops at the first record which is cut short or doesn't match its
+ * checksum, which is all a crash in the middle of an append can leave behind */
+#define JOURNAL_HEADER 8
+
+enum journal_op {
+	JOURNAL_SET = 'S',
+	JOURNAL_DELETE_VALUE = 'D',
+	JOURNAL_DELETE_GROUP = 'G',
+};
+
+typedef struct mini_journal_s {
+	FILE *f;
+	char *path;
+	size_t size;         /* Bytes appended since the last compaction */
+	size_t compact_size; /* Compact when size reaches this, 0 never */
+	int flags;           /* Passed on to mini_save when compacting */
+	int failed;          /* An append failed, the file may end in a partial record */
+	out_buffer_t record; /* Reused for every record */
+} mini_journal_t;
+
+static char *journal_path(const char *path)
+{
+	const size_t len = strlen(path);
+	char *result = mem_alloc(len + sizeof(".journal"));
+	memcpy(result, path, len);
+	memcpy(result + len, ".journal", sizeof(".journal"));
+	return result;
+}
+
+static FILE *journal_fopen(const char *path, const char *mode)
+{
+	FILE *fp = NULL;
+#if WIN32
+	fopen_s(&fp, path, mode);
+#else
+	fp = fopen(path, mode);
+#endif
+	return fp;
+}
+
+static unsigned int journal_checksum(const char *buf, size_t len)
+{
+	unsigned int h = 2166136261u;
+	while (len--) {
+		h ^= (unsigned char)*buf++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void journal_put_u32(char *buf, unsigned int v)
+{
+	for (int i = 0; i < 4; i++)
+		buf[i] = (char)(v >> (i * 8));
+}
+
+static unsigned int journal_get_u32(const char *buf)
+{
+	unsigned int v = 0;
+	for (int i = 0; i < 4; i++)
+		v |= (unsigned int)(unsigned char)buf[i] << (i * 8);
+	return v;
+}
+
+/* Returns the string at *pos and moves past it, NULL if it would go past end */
+static const char *journal_string(const char **pos, const char *end)
+{
+	const char *str = *pos;
+	if (str >= end)
+		return NULL;
+	*pos += strlen(str) + 1;
+	return str;
+}
+
+/* Applies the records in path.journal, the journal is closed while
+ * this runs so nothing gets appended again */
+static void replay_journal(mini_t *mini)
+{
+	char *path = journal_path(mini->path);
+	FILE *fp = journal_fopen(path, "rb");
+	mem_free(path);
+	if (!fp)
+		return;
+
+	char *buf = NULL;
+	long size = 0;
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		buf = mem_alloc(size);
+		if (buf && fread(buf, 1, size, fp) != (size_t)size)
+			size = 0;
+	}
+	fclose(fp);
+
+	const char *pos = buf, *end = buf + (buf ? size : 0);
+	while (end - pos >= JOURNAL_HEADER) {
+		const size_t len = journal_get_u32(pos);
+		const char *p = pos + JOURNAL_HEADER, *rec_end = p + len;
+
+		if (len < 3 || len > (size_t)(end - p) || rec_end[-1] != '\0' ||
+		    journal_checksum(p, len) != journal_get_u32(pos + 4))
+			break;
+
+		const char op = p[0];
+		const int has_group = p[1];
+		p += 2;
+
+		const char *group = has_group ? journal_string(&p, rec_end) : NULL;
+		const char *id = op != JOURNAL_DELETE_GROUP ? journal_string(&p, rec_end) : NULL;
+		const char *val = op == JOURNAL_SET ? journal_string(&p, rec_end) : NULL;
+
+		if (op == JOURNAL_SET && id && val)
+			mini_set_string(mini, group, id, val);
+		else if (op == JOURNAL_DELETE_VALUE && id)
+			mini_delete_value(mini, group, id);
+		else if (op == JOURNAL_DELETE_GROUP && group)
+			mini_delete_group(mini, group);
+		pos = rec_end;
+	}
+	mem_free(buf);
+}
+
+static int journal_sync(FILE *fp)
+{
+#if WIN32
+	return _commit(_fileno(fp));
+#else
+	return fsync(fileno(fp));
+#endif
+}
+
+/* Adds one record to the end of b */
+static void journal_record(out_buffer_t *b, char op, const char *group, const char *id, const char *val)
+{
+	const size_t start = b->len;
+	const char header[JOURNAL_HEADER + 2] = {0, 0, 0, 0, 0, 0, 0, 0, op, group != NULL};
+	buffer_append(b, header, sizeof(header));
+	if (group)
+		buffer_append(b, group, strlen(group) + 1);
+	if (id)
+		buffer_append(b, id, strlen(id) + 1);
+	if (val)
+		buffer_append(b, val, strlen(val) + 1);
+	if (b->failed)
+		return;
+
+	char *rec = b->data + start;
+	const size_t len = b->len - start - JOURNAL_HEADER;
+	journal_put_u32(rec, (unsigned int)len);
+	journal_put_u32(rec + 4, journal_checksum(rec + JOURNAL_HEADER, len));
+}
+
+/* Writes the records collected in j->record with one write and flush */
+static int journal_write(mini_journal_t *j)
+{
+	out_buffer_t *b = &j->record;
+	if (b->failed) {
+		b->failed = 0;
+		return MINI_OUT_OF_MEMORY;
+	}
+
+	if (fwrite(b->data, 1, b->len, j->f) != b->len || fflush(j->f) != 0 ||
+	    (j->flags & MINI_FLAGS_FSYNC && journal_sync(j->f) != 0)) {
+		j->failed = 1;
+		return MINI_WRITE_ERROR;
+	}
+	j->size += b->len;
+	return MINI_OK;
+}
+
+static int journal_full(const mini_journal_t *j)
+{
+	return j->compact_size && j->size >= j->compact_size;
+}
+
+static int journal_append(mini_t *mini, char op, const char *group, const char *id, const char *val)
+{
+	mini_journal_t *j = mini->journal;
+
+	/* A partial record would hide everything appended after it from
+	 * replay, so write the whole tree instead, which includes this change */
+	if (j->failed)
+		return mini_compact(mini);
+
+	j->record.len = 0;
+	journal_record(&j->record, op, group, id, val);
+	const int result = journal_write(j);
+	if (result == MINI_OK && journal_full(j))
+		return mini_compact(mini);
+	return result;
+}
+
+/* mini->path now holds everything, the records on top of it have to go */
+static void journal_reset(mini_t *mini)
+{
+	char *path = journal_path(mini->path);
+	mini_journal_t *j = mini->journal;
+
+	if (j && strcmp(j->path, path) == 0) {
+		FILE *fp = journal_fopen(path, "wb");
+		if (fp) {
+			fclose(j->f);
+			j->f = fp;
+			j->size = 0;
+			j->failed = 0;
+		} else {
+			j->failed = 1;
+		}
+	} else {
+		remove(path);
+	}
+	mem_free(path);
+}
+
+int mini_journal_open(mini_t *mini, int flags, size_t compact_size)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+	if (!mini->path || strlen(mini->path) < 1)
+		return MINI_INVALID_PATH;
+
+	mini_journal_close(mini);
+	mini_journal_t *j = mem_alloc(sizeof(mini_journal_t));
+	memset(j, 0, sizeof(mini_journal_t));
+	j->path = journal_path(mini->path);
+	j->f = journal_fopen(j->path, "ab");
+	if (!j->f) {
+		mem_free(j->path);
+		mem_free(j);
+		return MINI_ACCESS_DENIED;
+	}
+
+	fseek(j->f, 0, SEEK_END);
+	j->size = ftell(j->f);
+	j->flags = flags;
+	j->compact_size = compact_size;
+	mini->journal = j;
+
+	/* Records are only valid on top of a file matching the tree, so
+	 * start from a fresh file unless that's already the case */
+	if (!mini_synced(mini) || j->size > 0) {
+		const int result = mini_compact(mini);
+		if (result != MINI_OK)
+			mini_journal_close(mini);
+		return result;
+	}
+	return MINI_OK;
+}
+
+int mini_compact(mini_t *mini)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+	const int flags = mini->journal ? mini->journal->flags : MINI_FLAGS_NONE;
+	return mini_save(mini, flags | MINI_FLAGS_ATOMIC | MINI_FLAGS_FORCE);
+}
+
+void mini_journal_close(mini_t *mini)
+{
+	if (mini && mini->journal) {
+		fclose(mini->journal->f);
+		mem_free(mini->journal->path);
+		mem_free(mini->journal->record.data);
+		mem_free(mini->journal);
+		mini->journal = NULL;
+	}
+}
+
+/* === API implementation === */
+
+#if WIN32
+mini_t *mini_wcreate(const wchar_t *path)
+{
+	mini_t *result = mini_create(NULL);
+	if (path) {
+		char *utf8 = mini_utf8_from_wide_char(path);
+		result->path = mini_strdup(utf8);
+		free(utf8);
+	}
+	return result;
+}
+
+mini_t *mini_wtry_load_ex(const wchar_t *path, int *err)
+{
+	mini_t *result = mini_wload_ex(path, err);
+
+	if (!result)
+		result = mini_wcreate(path);
+	return result;
+}
+
+mini_t *mini_wload_ex(const wchar_t *path, int *err)
+{
+	mini_t *result = NULL;
+	struct _stat buf;
+
+	if (_wstat(path, &buf) != 0) {
+		if (err)
+			*err = MINI_FILE_NOT_FOUND;
+	} else {
+		FILE *fp = NULL;
+		_wfopen_s(&fp, path, L"r");
+
+		if (fp) {
+			result = mini_loadf(fp);
+			char *utf8 = mini_utf8_from_wide_char(path);
+			result->path = mini_strdup(utf8);
+			free(utf8);
+			fclose(fp);
+		} else if (err) {
+			*err = MINI_ACCESS_DENIED;
+		}
+	}
+
+	return result;
+}
+#endif
+
+/* A freed mini_t's address and generation can come back with the next
+ * one, so key handles also compare this number, which never repeats */
+static unsigned long long next_instance(void)
+{
+	static volatile long long counter = 0;
+#ifdef _WIN32
+	return (unsigned long long)InterlockedIncrement64(&counter);
+#else
+	return (unsigned long long)__atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static mini_t *create_mini(const char *path, int arena)
+{
+	mini_t *result = mem_alloc(sizeof(mini_t));
+	memset(result, 0, sizeof(mini_t));
+	result->instance = next_instance();
+#ifdef MINI_ENABLE_STATS
+	result->stats = mem_alloc(sizeof(mini_stats_t));
+	memset(result->stats, 0, sizeof(mini_stats_t));
+#endif
+	if (arena) {
+		result->arena = mem_alloc(sizeof(mini_arena_t));
+		memset(result->arena, 0, sizeof(mini_arena_t));
+	}
+	if (path)
+		result->path = mini_strdup(path);
+	result->head = make_group(result, NULL);
+	result->tail = result->head;
+	result->dirty = 1;
+	return result;
+}
+
+/* The contents match the file at mini->path */
+static void mark_synced(mini_t *mini)
+{
+	mini->dirty = 0;
+	mem_free(mini->synced_path);
+	mini->synced_path = mini->path ? mini_strdup(mini->path) : NULL;
+}
+
+mini_t *mini_create(const char *path)
+{
+	return create_mini(path, 0);
+}
+
+mini_t *mini_create_arena(const char *path)
+{
+	return create_mini(path, 1);
+}
+
+mini_t *mini_try_load_ex(const char *path, int *err)
+{
+	mini_t *result = mini_load_ex(path, err);
+
+	if (!result)
+		result = mini_create(path);
+	return result;
+}
+
+static mini_t *load_file(mini_t *result, FILE *f, int *err)
+{
+	MINI_STAT_START(start);
+	tree_builder_t b = {result, result->head, err};
+	mini_parse_stream(f, &tree_callbacks, &b);
+	MINI_STAT_TIME(result, load_ns, start);
+	return result;
+}
+
+static mini_t *load_path(const char *path, int arena, int *err)
+{
+	mini_t *result = NULL;
+	struct stat buf;
+
+	if (stat(path, &buf) != 0) {
+		if (err)
+			*err = MINI_FILE_NOT_FOUND;
+	} else {
+		FILE *fp = NULL;
+#if WIN32
+		fopen_s(&fp, path, "r");
+#else
+		fp = fopen(path, "r");
+#endif
+
+		if (fp) {
+			result = load_file(create_mini(NULL, arena), fp, err);
+			result->path = mini_strdup(path);
+			replay_journal(result);
+			mark_synced(result);
+			fclose(fp);
+		} else if (err) {
+			*err = MINI_ACCESS_DENIED;
+		}
+	}
+
+	return result;
+}
+
+mini_t *mini_load_ex(const char *path, int *err)
+{
+	return load_path(path, 0, err);
+}
+
+mini_t *mini_load_arena_ex(const char *path, int *err)
+{
+	return load_path(path, 1, err);
+}
+
+mini_t *mini_loadf_ex(FILE *f, int *err)
+{
+	return load_file(mini_create(NULL), f, err);
+}
+
+mini_t *mini_loadf_arena_ex(FILE *f, int *err)
+{
+	return load_file(mini_create_arena(NULL), f, err);
+}
+
+/* Splits a writable buffer into lines, the lines get null terminated in place */
+static int parse_buffer(parser_t *p, char *pos, char *end)
+{
+	while (pos < end) {
+		char *nl = scan_char(pos, end, '\n');
+		int stop;
+
+		if (nl) {
+			*nl = '\0';
+			stop = parse_line(p, pos, nl - pos);
+			pos = nl + 1;
+		} else {
+			/* No room for a terminator after the last line, copy it */
+			const size_t len = end - pos;
+			char *line = mem_alloc(len + 1);
+			memcpy(line, pos, len);
+			line[len] = '\0';
+			stop = parse_line(p, line, len);
+			mem_free(line);
+			pos = end;
+		}
+
+		if (stop)
+			return MINI_ABORTED;
+	}
+	return MINI_OK;
+}
+
+/* Splits a read only buffer into lines, each is copied before parsing */
+static int parse_copied(parser_t *p, const char *pos, const char *end)
+{
+	while (pos < end) {
+		const char *nl = scan_char((char *)pos, end, '\n');
+		const size_t len = (nl ? nl : end) - pos;
+
+		if (len + 1 > p->line_size) {
+			mem_free(p->line);
+			p->line_size = len + 1 > 256 ? len + 1 : 256;
+			p->line = mem_alloc(p->line_size);
+		}
+		memcpy(p->line, pos, len);
+		p->line[len] = '\0';
+		if (parse_line(p, p->line, len))
+			return MINI_ABORTED;
+		pos += len + 1;
+	}
+	return MINI_OK;
+}
+
+/* Maps a file privately, writable only if it is to be parsed in place.
+ * Empty files result in a NULL map */
+#ifdef _WIN32
+static int map_file(const char *path, char **map, size_t *size, int writable)
+{
+	struct _stat64 buf;
+	FILE *fp = NULL;
+
+	(void)writable;
+	*map = NULL;
+	*size = 0;
+	if (_stat64(path, &buf) != 0)
+		return MINI_FILE_NOT_FOUND;
+	if (fopen_s(&fp, path, "rb") != 0 || !fp)
+		return MINI_ACCESS_DENIED;
+
+	int result = MINI_OK;
+	if (buf.st_size > 0) {
+		*map = mem_alloc(buf.st_size);
+		*size = fread(*map, 1, buf.st_size, fp);
+		if (*size != (size_t)buf.st_size) {
+			mem_free(*map);
+			*map = NULL;
+			*size = 0;
+			result = MINI_READ_ERROR;
+		}
+	}
+	fclose(fp);
+	return result;
+}
+
+static void unmap_file(char *map, size_t size)
+{
+	(void)size;
+	mem_free(map);
+}
+
+static void map_drop(const char *from, const char *to)
+{
+	(void)from;
+	(void)to;
+}
+#else
+static int map_file(const char *path, char **map, size_t *size, int writable)
+{
+	struct stat buf;
+	const int fd = open(path, O_RDONLY);
+
+	*map = NULL;
+	*size = 0;
+	if (fd < 0)
+		return errno == ENOENT ? MINI_FILE_NOT_FOUND : MINI_ACCESS_DENIED;
+
+	int result = MINI_OK;
+	if (fstat(fd, &buf) != 0) {
+		result = MINI_READ_ERROR;
+	} else if (buf.st_size > 0) {
+		const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+		void *m = mmap(NULL, buf.st_size, prot, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			result = MINI_READ_ERROR;
+		} else {
+			*map = m;
+			*size = buf.st_size;
+		}
+	}
+	close(fd);
+	return result;
+}
+
+static void unmap_file(char *map, size_t size)
+{
+	munmap(map, size);
+}
+
+/* Gives back the whole pages of a read only map between from and to,
+ * they are read from the file again if touched later */
+static void map_drop(const char *from, const char *to)
+{
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	const uintptr_t first = ((uintptr_t)from + page - 1) & ~(page - 1);
+	const uintptr_t last = (uintptr_t)to & ~(page - 1);
+	if (last > first)
+		madvise((void *)first, last - first, MADV_DONTNEED);
+}
+#endif
+
+/* Parses a buffer from map_file in place, the mini_t owns it afterwards */
+static mini_t *load_map(const char *path, char *map, size_t size, int *err)
+{
+	MINI_STAT_START(start);
+	mini_t *mini = create_mini(path, 1);
+	mini->map = map;
+	mini->map_size = size;
+
+	tree_builder_t b = {mini, mini->head, err};
+	parser_t p = {&tree_callbacks, &b, NULL, 0, NULL, 0};
+	parse_buffer(&p, map, map + size);
+	parser_free(&p);
+	MINI_STAT_TIME(mini, load_ns, start);
+	replay_journal(mini);
+	mark_synced(mini);
+	return mini;
+}
+
+mini_t *mini_load_mmap(const char *path, int *err)
+{
+	char *map;
+	size_t size;
+	const int result = map_file(path, &map, &size, 1);
+
+	if (result != MINI_OK) {
+		if (err)
+			*err = result;
+		return NULL;
+	}
+	return load_map(path, map, size, err);
+}
+
+/* === Threads === */
+
+typedef void (*mini_thread_fn)(void *arg);
+
+#ifdef _WIN32
+typedef struct mini_thread_s {
+	HANDLE handle;
+	mini_thread_fn fn;
+	void *arg;
+} mini_thread_t;
+
+static DWORD WINAPI thread_main(LPVOID arg)
+{
+	mini_thread_t *t = arg;
+	t->fn(t->arg);
+	return 0;
+}
+
+static int thread_start(mini_thread_t *t, mini_thread_fn fn, void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	t->handle = CreateThread(NULL, 0, thread_main, t, 0, NULL);
+	return t->handle != NULL;
+}
+
+static void thread_join(mini_thread_t *t)
+{
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+}
+
+typedef SRWLOCK mini_mutex_t;
+typedef CONDITION_VARIABLE mini_cond_t;
+#define MINI_MUTEX_INIT SRWLOCK_INIT
+#define MINI_COND_INIT CONDITION_VARIABLE_INIT
+
+static void mutex_lock(mini_mutex_t *m)
+{
+	AcquireSRWLockExclusive(m);
+}
+
+static void mutex_unlock(mini_mutex_t *m)
+{
+	ReleaseSRWLockExclusive(m);
+}
+
+static void cond_wait(mini_cond_t *c, mini_mutex_t *m)
+{
+	SleepConditionVariableSRW(c, m, INFINITE, 0);
+}
+
+static void cond_broadcast(mini_cond_t *c)
+{
+	WakeAllConditionVariable(c);
+}
+#else
+typedef struct mini_thread_s {
+	pthread_t handle;
+	mini_thread_fn fn;
+	void *arg;
+} mini_thread_t;
+
+static void *thread_main(void *arg)
+{
+	mini_thread_t *t = arg;
+	t->fn(t->arg);
+	return NULL;
+}
+
+static int thread_start(mini_thread_t *t, mini_thread_fn fn, void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	return pthread_create(&t->handle, NULL, thread_main, t) == 0;
+}
+
+static void thread_join(mini_thread_t *t)
+{
+	pthread_join(t->handle, NULL);
+}
+
+typedef pthread_mutex_t mini_mutex_t;
+typedef pthread_cond_t mini_cond_t;
+#define MINI_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define MINI_COND_INIT PTHREAD_COND_INITIALIZER
+
+static void mutex_lock(mini_mutex_t *m)
+{
+	pthread_mutex_lock(m);
+}
+
+static void mutex_unlock(mini_mutex_t *m)
+{
+	pthread_mutex_unlock(m);
+}
+
+static void cond_wait(mini_cond_t *c, mini_mutex_t *m)
+{
+	pthread_cond_wait(c, m);
+}
+
+static void cond_broadcast(mini_cond_t *c)
+{
+	pthread_cond_broadcast(c);
+}
+#endif
+
+/* Sequentially consistent atomics, used by the snapshot publishing */
+#ifdef _WIN32
+typedef volatile LONG mini_atomic_t;
+
+static long mini_atomic_add(mini_atomic_t *a, long v)
+{
+	return InterlockedExchangeAdd(a, v) + v;
+}
+
+static long mini_atomic_load(mini_atomic_t *a)
+{
+	return InterlockedCompareExchange(a, 0, 0);
+}
+
+static long mini_atomic_swap(mini_atomic_t *a, long v)
+{
+	return InterlockedExchange(a, v);
+}
+
+static void *mini_atomic_load_ptr(void *volatile *p)
+{
+	return InterlockedCompareExchangePointer(p, NULL, NULL);
+}
+
+static void *mini_atomic_swap_ptr(void *volatile *p, void *v)
+{
+	return InterlockedExchangePointer(p, v);
+}
+
+static void thread_yield(void)
+{
+	SwitchToThread();
+}
+#else
+typedef volatile long mini_atomic_t;
+
+static long mini_atomic_add(mini_atomic_t *a, long v)
+{
+	return __atomic_add_fetch(a, v, __ATOMIC_SEQ_CST);
+}
+
+static long mini_atomic_load(mini_atomic_t *a)
+{
+	return __atomic_load_n(a, __ATOMIC_SEQ_CST);
+}
+
+static long mini_atomic_swap(mini_atomic_t *a, long v)
+{
+	return __atomic_exchange_n(a, v, __ATOMIC_SEQ_CST);
+}
+
+static void *mini_atomic_load_ptr(void *volatile *p)
+{
+	return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void *mini_atomic_swap_ptr(void *volatile *p, void *v)
+{
+	return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static void thread_yield(void)
+{
+	sched_yield();
+}
+#endif
+
+/* === Parallel loading === */
+
+/* Files are split into pieces of at least this size */
+#define MINI_PARALLEL_MIN_SIZE (1024 * 1024)
+/* Parsed parts of the mapping are given back in steps of this size */
+#define MINI_PARALLEL_DROP_SIZE (4 * 1024 * 1024)
+
+typedef struct load_job_s {
+	const char *start;
+	const char *end;
+	mini_t *mini;
+} load_job_t;
+
+/* The builders copy every string anyway, so lines are copied out of the
+ * read only mapping instead of terminating them in place, which would
+ * duplicate every page of the file. Parsed pages are dropped as it goes */
+static void load_job_run(void *arg)
+{
+	load_job_t *job = arg;
+	tree_builder_t b = {job->mini, job->mini->head, NULL};
+	parser_t p = {&tree_callbacks, &b, NULL, 0, NULL, 0};
+	const char *pos = job->start;
+
+	while (pos < job->end) {
+		const char *nl = NULL;
+		if ((size_t)(job->end - pos) > MINI_PARALLEL_DROP_SIZE)
+			nl = scan_char((char *)pos + MINI_PARALLEL_DROP_SIZE, job->end, '\n');
+		const char *to = nl ? nl + 1 : job->end;
+		parse_copied(&p, pos, to);
+		map_drop(pos, to);
+		pos = to;
+	}
+	parser_free(&p);
+}
+
+/* Moves all values of src behind those of dst, earlier ones win on duplicates */
+static void merge_values(mini_t *dst, mini_group_t *target, mini_t *src, mini_group_t *grp)
+{
+	mini_value_t *v = grp->tail, *prev = NULL;
+
+	while (v) {
+		prev = v->prev;
+		const unsigned int hash = mini_hash(v->id);
+		if (table_find(&target->values, v->id, hash)) {
+			free_value(src, grp, v);
+		} else {
+			attach_value(dst, target, v, hash);
+		}
+		v = prev;
+	}
+
+	table_free(src, &grp->values);
+	grp->head = NULL;
+	grp->tail = NULL;
+}
+
+/* Moves all groups and values of src into dst as if the lines of src came
+ * after those of dst, src is freed afterwards. Both have to use the heap */
+static void merge_into(mini_t *dst, mini_t *src)
+{
+	mini_group_t *grp = src->head->next, *next = NULL;
+
+	merge_values(dst, dst->head, src, src->head);
+
+	while (grp) {
+		next = grp->next;
+		mini_group_t *target = get_group(dst, grp->id, 0);
+
+		table_remove(&src->groups, grp, mini_hash(grp->id));
+		if (target) {
+			merge_values(dst, target, src, grp);
+			free_group(src, grp);
+		} else {
+			/* New group, take it over with its values and index */
+			add_group(dst, grp);
+		}
+		grp = next;
+	}
+
+	src->head->next = NULL;
+	src->tail = src->head;
+
+	/* Everything src still accounts for after this was moved to dst */
+	free_group(src, src->head);
+	table_free(src, &src->groups);
+	src->head = NULL;
+
+	/* The moved values keep their atoms, so an id can end up with one atom
+	 * per merged chunk. Lookups compare the strings, which copes with that */
+	for (size_t i = 0; src->atoms.slots && i <= src->atoms.mask; i++) {
+		if (src->atoms.slots[i].node)
+			table_insert(dst, &dst->atoms, src->atoms.slots[i].node, src->atoms.slots[i].hash);
+	}
+	table_free(src, &src->atoms);
+	dst->memory += src->memory;
+#ifdef MINI_ENABLE_STATS
+	dst->stats->allocations += src->stats->allocations;
+#endif
+	mini_free(src);
+}
+
+/* Returns the first group header at or after pos */
+static char *find_group_start(char *start, char *pos, char *end)
+{
+	if (pos > start && pos[-1] != '\n') {
+		pos = scan_char(pos, end, '\n');
+		if (!pos)
+			return end;
+		pos++;
+	}
+
+	while (pos < end && *pos != '[') {
+		pos = scan_char(pos, end, '\n');
+		if (!pos)
+			return end;
+		pos++;
+	}
+	return pos;
+}
+
+mini_t *mini_load_parallel(const char *path, int nthreads, int *err)
+{
+	char *map;
+	size_t size;
+	const int result = map_file(path, &map, &size, 0);
+
+	if (result != MINI_OK) {
+		if (err)
+			*err = result;
+		return NULL;
+	}
+
+	MINI_STAT_START(start);
+	if (nthreads < 1)
+		nthreads = 1;
+	if ((size_t)nthreads > size / MINI_PARALLEL_MIN_SIZE + 1)
+		nthreads = (int)(size / MINI_PARALLEL_MIN_SIZE + 1);
+
+	/* Every piece but the first starts with a group header, so all pieces
+	 * can be parsed on their own and merged in order afterwards */
+	load_job_t *jobs = mem_calloc(nthreads, sizeof(load_job_t));
+	mini_thread_t *threads = mem_calloc(nthreads, sizeof(mini_thread_t));
+	char *pos = map, *end = map + size;
+	int count = 0, i;
+
+	for (i = 0; i < nthreads && (pos < end || count == 0); i++) {
+		char *split = end;
+		if (i < nthreads - 1) {
+			char *target = map + size / nthreads * (i + 1);
+			split = find_group_start(map, target > pos ? target : pos, end);
+		}
+		if (split == pos && count > 0)
+			continue;
+
+		jobs[count].start = pos;
+		jobs[count].end = split;
+		jobs[count].mini = create_mini(NULL, 0);
+		count++;
+		pos = split;
+	}
+
+	int *started = mem_calloc(count, sizeof(int));
+	for (i = 1; i < count; i++)
+		started[i] = thread_start(&threads[i], load_job_run, &jobs[i]);
+	load_job_run(&jobs[0]);
+
+	for (i = 1; i < count; i++) {
+		if (started[i])
+			thread_join(&threads[i]);
+		else
+			load_job_run(&jobs[i]);
+	}
+
+	mini_t *mini = jobs[0].mini;
+	for (i = 1; i < count; i++)
+		merge_into(mini, jobs[i].mini);
+	mini->path = mini_strdup(path);
+	replay_journal(mini);
+	mark_synced(mini);
+	MINI_STAT_TIME(mini, load_ns, start);
+
+	if (map)
+		unmap_file(map, size);
+	mem_free(started);
+	mem_free(threads);
+	mem_free(jobs);
+	return mini;
+}
+
+/* === Watching === */
+
+/* Files without a change notification API are checked this often */
+#define MINI_WATCH_POLL_MS 1000
+
+typedef struct file_stamp_s {
+	long long size;
+	long long mtime;
+	long long mtime_nsec;
+	unsigned long long inode;
+} file_stamp_t;
+
+struct mini_watch_s {
+	char *path;
+	const char *name; /* File name part of path */
+	char *journal;    /* path.journal, see mini_journal_open */
+	mini_watch_fn fn;
+	void *user;
+	file_stamp_t stamp;      /* Of the last loaded version  */
+	file_stamp_t journal_stamp;
+	unsigned long long hash; /* Of its contents             */
+	mini_thread_t thread;
+#ifdef _WIN32
+	HANDLE stop;
+#else
+	int stop[2];  /* Written to by mini_unwatch   */
+	int inotify;  /* -1 if the file is polled     */
+#endif
+};
+
+static void file_stamp(const char *path, file_stamp_t *stamp)
+{
+	memset(stamp, 0, sizeof(file_stamp_t));
+#ifdef _WIN32
+	struct _stat64 buf;
+	if (_stat64(path, &buf) == 0) {
+		stamp->size = buf.st_size;
+		stamp->mtime = buf.st_mtime;
+	}
+#else
+	struct stat buf;
+	if (stat(path, &buf) == 0) {
+		stamp->size = buf.st_size;
+		stamp->mtime = buf.st_mtime;
+#ifdef __linux__
+		stamp->mtime_nsec = buf.st_mtim.tv_nsec;
+#endif
+		stamp->inode = buf.st_ino;
+	}
+#endif
+}
+
+/* 64 bit FNV-1a */
+static unsigned long long content_hash(const char *buf, size_t len)
+{
+	unsigned long long h = 14695981039346656037ull;
+	while (len--) {
+		h ^= (unsigned char)*buf++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/* Returns whether the contents changed and maps the file if so.
+ * Anything appended to the journal counts as a change */
+static int watch_read(mini_watch_t *w, char **map, size_t *size)
+{
+	file_stamp_t stamp, journal;
+
+	file_stamp(w->path, &stamp);
+	file_stamp(w->journal, &journal);
+	const int journal_changed = memcmp(&journal, &w->journal_stamp, sizeof(journal)) != 0;
+	if (!journal_changed && memcmp(&stamp, &w->stamp, sizeof(stamp)) == 0)
+		return 0;
+
+	w->stamp = stamp;
+	w->journal_stamp = journal;
+	if (map_file(w->path, map, size, 0) != MINI_OK)
+		return 0;
+
+	/* Touched or rewritten with the same contents */
+	const unsigned long long hash = content_hash(*map, *size);
+	if (hash == w->hash && !journal_changed) {
+		unmap_file(*map, *size);
+		return 0;
+	}
+	w->hash = hash;
+	return 1;
+}
+
+static void watch_check(mini_watch_t *w)
+{
+	char *map;
+	size_t size;
+
+	if (!watch_read(w, &map, &size))
+		return;
+
+	/* A tree parsed in place would break with the next in place rewrite
+	 * of the very file being watched, so fn gets copies on the heap */
+	unmap_file(map, size);
+	mini_t *mini = load_path(w->path, 0, NULL);
+	if (mini)
+		w->fn(mini, w->user);
+}
+
+#ifdef _WIN32
+static void watch_run(void *arg)
+{
+	mini_watch_t *w = arg;
+	const char *slash = w->name > w->path ? w->name - 1 : NULL;
+	char *dir = NULL;
+
+	if (slash) {
+		dir = mem_alloc(slash - w->path + 2);
+		memcpy(dir, w->path, slash - w->path + 1);
+		dir[slash - w->path + 1] = '\0';
+	}
+
+	wchar_t *wdir = mini_utf8_to_wide_char(dir ? dir : ".");
+	HANDLE change = FindFirstChangeNotificationW(
+		wdir, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE);
+	HANDLE handles[2] = {w->stop, change};
+	free(wdir);
+	mem_free(dir);
+
+	for (;;) {
+		const int have_change = change != INVALID_HANDLE_VALUE;
+		const DWORD r = WaitForMultipleObjects(have_change ? 2 : 1, handles, FALSE,
+		                                       have_change ? INFINITE : MINI_WATCH_POLL_MS);
+		if (r == WAIT_OBJECT_0 || r == WAIT_FAILED)
+			break;
+		watch_check(w);
+		if (have_change)
+			FindNextChangeNotification(change);
+	}
+
+	if (change != INVALID_HANDLE_VALUE)
+		FindCloseChangeNotification(change);
+}
+
+static int watch_start(mini_watch_t *w)
+{
+	w->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!w->stop)
+		return 0;
+	if (!thread_start(&w->thread, watch_run, w)) {
+		CloseHandle(w->stop);
+		return 0;
+	}
+	return 1;
+}
+
+static void watch_stop(mini_watch_t *w)
+{
+	SetEvent(w->stop);
+	thread_join(&w->thread);
+	CloseHandle(w->stop);
+}
+#else
+/* Reads all pending events, returns whether one was about the file */
+static int watch_events(mini_watch_t *w)
+{
+	union {
+		struct inotify_event event;
+		char buf[4096];
+	} u;
+	int changed = 0;
+	ssize_t len;
+
+	/* The file only counts once it was closed or moved in place,
+	 * the journal stays open and is only ever appended to */
+	const char *journal = w->journal + (w->name - w->path);
+	while ((len = read(w->inotify, u.buf, sizeof(u.buf))) > 0) {
+		for (char *p = u.buf; p < u.buf + len;) {
+			const struct inotify_event *e = (const struct inotify_event *)p;
+			if (e->len && ((!(e->mask & IN_MODIFY) && strcmp(e->name, w->name) == 0) || strcmp(e->name, journal) == 0))
+				changed = 1;
+			p += sizeof(struct inotify_event) + e->len;
+		}
+	}
+	return changed;
+}
+
+static void watch_run(void *arg)
+{
+	mini_watch_t *w = arg;
+	struct pollfd fds[2] = {{w->stop[0], POLLIN, 0}, {w->inotify, POLLIN, 0}};
+
+	for (;;) {
+		const int n = w->inotify >= 0 ? poll(fds, 2, -1) : poll(fds, 1, MINI_WATCH_POLL_MS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents)
+			break;
+		if (w->inotify < 0 || watch_events(w))
+			watch_check(w);
+	}
+}
+
+static int watch_start(mini_watch_t *w)
+{
+	if (pipe(w->stop) != 0)
+		return 0;
+
+	w->inotify = -1;
+#ifdef __linux__
+	/* Watch the directory, so replacing the file by renaming is noticed too */
+	w->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->inotify >= 0) {
+		const size_t len = w->name - w->path;
+		char *dir = mem_alloc(len + 2);
+		memcpy(dir, len ? w->path : ".", len ? len : 1);
+		dir[len ? len : 1] = '\0';
+		if (inotify_add_watch(w->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY) < 0) {
+			close(w->inotify);
+			w->inotify = -1;
+		}
+		mem_free(dir);
+	}
+#endif
+
+	if (!thread_start(&w->thread, watch_run, w)) {
+		if (w->inotify >= 0)
+			close(w->inotify);
+		close(w->stop[0]);
+		close(w->stop[1]);
+		return 0;
+	}
+	return 1;
+}
+
+static void watch_stop(mini_watch_t *w)
+{
+	const char c = 0;
+	while (write(w->stop[1], &c, 1) < 0 && errno == EINTR)
+		;
+	thread_join(&w->thread);
+	if (w->inotify >= 0)
+		close(w->inotify);
+	close(w->stop[0]);
+	close(w->stop[1]);
+}
+#endif
+
+mini_watch_t *mini_watch(const char *path, mini_watch_fn fn, void *user, int *err)
+{
+	if (!path || !fn) {
+		if (err)
+			*err = MINI_INVALID_ARG;
+		return NULL;
+	}
+
+	mini_watch_t *w = mem_alloc(sizeof(mini_watch_t));
+	memset(w, 0, sizeof(mini_watch_t));
+	w->path = mini_strdup(path);
+	w->journal = journal_path(path);
+	w->name = w->path;
+	w->fn = fn;
+	w->user = user;
+	for (const char *p = w->path; *p; p++) {
+		if (*p == '/' || *p == '\\')
+			w->name = p + 1;
+	}
+
+	/* Only changes after this point are reported */
+	char *map;
+	size_t size;
+	if (watch_read(w, &map, &size))
+		unmap_file(map, size);
+
+	if (!watch_start(w)) {
+		mem_free(w->path);
+		mem_free(w->journal);
+		mem_free(w);
+		if (err)
+			*err = MINI_OUT_OF_MEMORY;
+		return NULL;
+	}
+	return w;
+}
+
+void mini_unwatch(mini_watch_t *watch)
+{
+	if (watch) {
+		watch_stop(watch);
+		mem_free(watch->path);
+		mem_free(watch->journal);
+		mem_free(watch);
+	}
+}
+
+#if WIN32
+static int write_file(const char *path, const char *buf, size_t len, int flags)
+{
+	int result = MINI_OK;
+	FILE *fp = NULL;
+	wchar_t *wpath = mini_utf8_to_wide_char(path);
+	wchar_t *target = wpath;
+
+	/* Write next to the target, then move it over the target */
+	if (flags & MINI_FLAGS_ATOMIC) {
+		const size_t wlen = wcslen(wpath);
+		target = mem_alloc((wlen + 5) * sizeof(wchar_t));
+		memcpy(target, wpath, wlen * sizeof(wchar_t));
+		memcpy(target + wlen, L".tmp", 5 * sizeof(wchar_t));
+	}
+
+	_wfopen_s(&fp, target, L"w");
+	if (!fp) {
+		result = MINI_ACCESS_DENIED;
+	} else {
+		if (fwrite(buf, 1, len, fp) != len || fflush(fp) != 0)
+			result = MINI_WRITE_ERROR;
+		if (result == MINI_OK && flags & MINI_FLAGS_FSYNC && _commit(_fileno(fp)) != 0)
+			result = MINI_WRITE_ERROR;
+		if (fclose(fp) != 0)
+			result = MINI_WRITE_ERROR;
+	}
+
+	if (target != wpath) {
+		if (result == MINI_OK && !MoveFileExW(target, wpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			result = MINI_WRITE_ERROR;
+		if (result != MINI_OK)
+			_wremove(target);
+		mem_free(target);
+	}
+	free(wpath);
+	return result;
+}
+#else
+/* Writes all of buf, retrying on short writes */
+static int write_fd(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return MINI_WRITE_ERROR;
+		}
+		buf += n;
+		len -= n;
+	}
+	return MINI_OK;
+}
+
+/* Makes a rename in the directory of path durable */
+static void sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = NULL;
+
+	if (slash) {
+		const size_t len = slash == path ? 1 : (size_t)(slash - path);
+		dir = mem_alloc(len + 1);
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+	}
+
+	const int fd = open(dir ? dir : ".", O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	mem_free(dir);
+}
+
+static int write_file(const char *path, const char *buf, size_t len, int flags)
+{
+	if (!(flags & MINI_FLAGS_ATOMIC)) {
+		const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0)
+			return MINI_ACCESS_DENIED;
+
+		int result = write_fd(fd, buf, len);
+		if (result == MINI_OK && flags & MINI_FLAGS_FSYNC && fsync(fd) != 0)
+			result = MINI_WRITE_ERROR;
+		if (close(fd) != 0)
+			result = MINI_WRITE_ERROR;
+		return result;
+	}
+
+	/* Write a temporary file in the same directory and rename it over the
+	 * target, so the target is either the old or the new file after a crash */
+	static mini_atomic_t counter = 0;
+	const size_t tmp_size = strlen(path) + 48;
+	char *tmp = mem_alloc(tmp_size);
+	int fd = -1;
+
+	for (int tries = 0; tries < 16 && fd < 0; tries++) {
+		snprintf(tmp, tmp_size, "%s.%ld.%ld.tmp", path, (long)getpid(), mini_atomic_add(&counter, 1));
+		fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0 && errno != EEXIST)
+			break;
+	}
+
+	if (fd < 0) {
+		mem_free(tmp);
+		return MINI_ACCESS_DENIED;
+	}
+
+	/* Keep the permissions of the file being replaced */
+	struct stat st;
+	if (stat(path, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+
+	int result = write_fd(fd, buf, len);
+	if (result == MINI_OK && flags & MINI_FLAGS_FSYNC && fsync(fd) != 0)
+		result = MINI_WRITE_ERROR;
+	if (close(fd) != 0)
+		result = MINI_WRITE_ERROR;
+	if (result == MINI_OK && rename(tmp, path) != 0)
+		result = MINI_WRITE_ERROR;
+
+	if (result != MINI_OK)
+		unlink(tmp);
+	else if (flags & MINI_FLAGS_FSYNC)
+		sync_dir(path);
+	mem_free(tmp);
+	return result;
+}
+#endif
+
+static void save_settle(mini_t *mini, int wait);
+
+/* Truncating a file drops its private mappings as well, so a tree from
+ * mini_load_mmap is only ever written by rename */
+static int save_flags(const mini_t *mini, int flags)
+{
+	return mini->map ? flags | MINI_FLAGS_ATOMIC : flags;
+}
+
+int mini_save(mini_t *mini, int flags)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+	if (!mini->path || strlen(mini->path) < 1)
+		return MINI_INVALID_PATH;
+
+	/* A queued older save mustn't land on top of this one */
+	save_settle(mini, 1);
+
+	/* Nothing changed since this path was loaded or saved */
+	if (mini_synced(mini) && !(flags & MINI_FLAGS_FORCE))
+		return MINI_OK;
+
+	MINI_STAT_START(start);
+	out_buffer_t b = {NULL, 0, 0, 0};
+	int result = serialize(mini, flags, &b);
+
+	if (result == MINI_OK)
+		result = write_file(mini->path, b.data, b.len, save_flags(mini, flags));
+	if (result == MINI_OK) {
+		journal_reset(mini);
+		mark_synced(mini);
+	}
+	mem_free(b.data);
+	MINI_STAT_TIME(mini, save_ns, start);
+	return result;
+}
+
+int mini_savef(const mini_t *mini, FILE *f, int flags)
+{
+	if (!f || !mini)
+		return MINI_INVALID_ARG;
+
+	MINI_STAT_START(start);
+	out_buffer_t b = {NULL, 0, 0, 0};
+	int result = serialize(mini, flags, &b);
+
+	if (result == MINI_OK && fwrite(b.data, 1, b.len, f) != b.len)
+		result = MINI_WRITE_ERROR;
+	mem_free(b.data);
+	MINI_STAT_TIME(mini, save_ns, start);
+	return result;
+}
+
+/* Saves queued by mini_save_async, written one after the other by a
+ * thread which runs while there is something to write */
+
+/* mini_t.dirty while its unchanged tree is being written by the saver */
+#define MINI_DIRTY_SAVING 2
+
+/* Outcome of the async saves of one instance, shared by the instance and
+ * its queued requests so either can go first. Guarded by saver.lock */
+struct mini_save_state_s {
+	int refs;
+	unsigned long long seq;  /* Of the last queued request              */
+	unsigned long long done; /* Last request whose write finished       */
+	int result;              /* Of that write                           */
+	char *path;              /* Written by the last request, owner only */
+};
+
+typedef struct save_waiter_s {
+	mini_save_fn fn; /* Can be NULL */
+	void *user;
+	struct mini_save_state_s *state;
+	unsigned long long seq;
+	struct save_waiter_s *next;
+} save_waiter_t;
+
+typedef struct save_job_s {
+	char *path;
+	char *buf;
+	size_t len;
+	int flags;
+	save_waiter_t *waiters; /* Every request this write stands for */
+	struct save_job_s *next;
+} save_job_t;
+
+static struct {
+	mini_mutex_t lock;
+	mini_cond_t idle;
+	mini_cond_t done; /* A job was written */
+	save_job_t *head;
+	save_job_t *tail;
+	mini_thread_t thread;
+	int running;  /* The thread takes jobs off the queue  */
+	int joinable; /* The thread ran and wasn't joined yet */
+} saver = {MINI_MUTEX_INIT, MINI_COND_INIT, MINI_COND_INIT, NULL, NULL, {0}, 0, 0};
+
+/* Needs saver.lock */
+static void save_state_release(struct mini_save_state_s *state)
+{
+	if (--state->refs == 0) {
+		mem_free(state->path);
+		mem_free(state);
+	}
+}
+
+static void save_job_run(save_job_t *job)
+{
+	const int result = write_file(job->path, job->buf, job->len, job->flags);
+	save_waiter_t *w = job->waiters, *next = NULL;
+
+	/* Replaying records from before this save would undo it, as in journal_reset */
+	if (result == MINI_OK) {
+		char *journal = journal_path(job->path);
+		remove(journal);
+		mem_free(journal);
+	}
+
+	/* Only the last request of an instance decides whether it is saved */
+	mutex_lock(&saver.lock);
+	for (w = job->waiters; w; w = w->next) {
+		if (w->seq == w->state->seq) {
+			w->state->done = w->seq;
+			w->state->result = result;
+		}
+		save_state_release(w->state);
+	}
+	cond_broadcast(&saver.done);
+	mutex_unlock(&saver.lock);
+
+	w = job->waiters;
+	while (w) {
+		next = w->next;
+		if (w->fn)
+			w->fn(result, w->user);
+		mem_free(w);
+		w = next;
+	}
+	mem_free(job->path);
+	mem_free(job->buf);
+	mem_free(job);
+}
+
+static void saver_main(void *arg)
+{
+	(void)arg;
+	mutex_lock(&saver.lock);
+	while (saver.head) {
+		save_job_t *job = saver.head;
+		saver.head = job->next;
+		if (!saver.head)
+			saver.tail = NULL;
+
+		mutex_unlock(&saver.lock);
+		save_job_run(job);
+		mutex_lock(&saver.lock);
+	}
+	saver.running = 0;
+	cond_broadcast(&saver.idle);
+	mutex_unlock(&saver.lock);
+}
+
+/* Takes over buf and waiter. A save of the same path which is still
+ * waiting gets the newer contents instead of queueing a second write */
+static void saver_queue(const char *path, char *buf, size_t len, int flags, save_waiter_t *waiter)
+{
+	mutex_lock(&saver.lock);
+	waiter->seq = ++waiter->state->seq;
+	waiter->state->refs++;
+
+	save_job_t *job = saver.head;
+	while (job && strcmp(job->path, path) != 0)
+		job = job->next;
+
+	if (job) {
+		save_waiter_t **last = &job->waiters;
+		while (*last)
+			last = &(*last)->next;
+		*last = waiter;
+		mem_free(job->buf);
+		job->buf = buf;
+		job->len = len;
+		job->flags |= flags;
+		mutex_unlock(&saver.lock);
+		return;
+	}
+
+	job = mem_alloc(sizeof(save_job_t));
+	job->path = mini_strdup(path);
+	job->buf = buf;
+	job->len = len;
+	job->flags = flags;
+	job->waiters = waiter;
+	job->next = NULL;
+	if (saver.tail)
+		saver.tail->next = job;
+	else
+		saver.head = job;
+	saver.tail = job;
+
+	/* The queue was empty, so the last thread is done or about to be */
+	if (!saver.running) {
+		if (saver.joinable)
+			thread_join(&saver.thread);
+		saver.running = thread_start(&saver.thread, saver_main, NULL);
+		saver.joinable = saver.running;
+		if (!saver.running) {
+			saver.head = NULL;
+			saver.tail = NULL;
+		}
+	}
+
+	const int running = saver.running;
+	mutex_unlock(&saver.lock);
+
+	/* No thread to be had, write it here instead */
+	if (!running)
+		save_job_run(job);
+}
+
+int mini_save_async(mini_t *mini, int flags, mini_save_fn on_done, void *user)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+	if (!mini->path || strlen(mini->path) < 1)
+		return MINI_INVALID_PATH;
+	if (mini->journal)
+		return MINI_UNSUPPORTED;
+
+	save_settle(mini, 0);
+	if (mini_synced(mini) && !(flags & MINI_FLAGS_FORCE)) {
+		if (on_done)
+			on_done(MINI_OK, user);
+		return MINI_OK;
+	}
+
+	MINI_STAT_START(start);
+	out_buffer_t b = {NULL, 0, 0, 0};
+	int result = serialize(mini, flags, &b);
+	MINI_STAT_TIME(mini, save_ns, start);
+	if (result != MINI_OK) {
+		mem_free(b.data);
+		return result;
+	}
+
+	if (!mini->save_state) {
+		mini->save_state = mem_calloc(1, sizeof(struct mini_save_state_s));
+		mini->save_state->refs = 1;
+	}
+	mem_free(mini->save_state->path);
+	mini->save_state->path = mini_strdup(mini->path);
+
+	save_waiter_t *waiter = mem_alloc(sizeof(save_waiter_t));
+	waiter->fn = on_done;
+	waiter->user = user;
+	waiter->state = mini->save_state;
+	waiter->next = NULL;
+
+	/* Any change from here on sets it back to 1 */
+	mini->dirty = MINI_DIRTY_SAVING;
+	saver_queue(mini->path, b.data, b.len, save_flags(mini, flags), waiter);
+	return MINI_OK;
+}
+
+/* Takes over the outcome of the last async save, which only counts if
+ * nothing changed since it was queued. With wait set it waits for it */
+static void save_settle(mini_t *mini, int wait)
+{
+	struct mini_save_state_s *state = mini->save_state;
+	if (!state)
+		return;
+
+	mutex_lock(&saver.lock);
+	while (wait && state->done != state->seq)
+		cond_wait(&saver.done, &saver.lock);
+	const int done = state->done == state->seq;
+	const int result = state->result;
+	mutex_unlock(&saver.lock);
+
+	if (!done || mini->dirty != MINI_DIRTY_SAVING)
+		return;
+	if (result == MINI_OK) {
+		mini->dirty = 0;
+		mem_free(mini->synced_path);
+		mini->synced_path = mini_strdup(state->path);
+	} else {
+		mini->dirty = 1;
+	}
+}
+
+void mini_save_async_flush(void)
+{
+	mutex_lock(&saver.lock);
+	while (saver.running)
+		cond_wait(&saver.idle, &saver.lock);
+	if (saver.joinable) {
+		thread_join(&saver.thread);
+		saver.joinable = 0;
+	}
+	mutex_unlock(&saver.lock);
+}
+
+int mini_save_to_buffer(const mini_t *mini, int flags, char **buf, size_t *len)
+{
+	if (!mini || !buf)
+		return MINI_INVALID_ARG;
+
+	out_buffer_t b = {NULL, 0, 0, 0};
+	const int result = serialize(mini, flags, &b);
+
+	*buf = b.data;
+	if (len)
+		*len = b.len;
+	return result;
+}
+
+void mini_free_buffer(char *buf)
+{
+	mem_free(buf);
+}
+
+mini_stats_t mini_get_stats(const mini_t *mini)
+{
+	mini_stats_t stats;
+	memset(&stats, 0, sizeof(stats));
+	if (mini && mini->stats) {
+		stats = *mini->stats;
+		stats.bytes = mini_memory_usage(mini);
+	}
+	return stats;
+}
+
+size_t mini_memory_usage(const mini_t *mini)
+{
+	if (!mini)
+		return 0;
+	return sizeof(mini_t) + mini->memory + (mini->arena ? sizeof(mini_arena_t) + mini->arena->size : 0);
+}
+
+void mini_free(mini_t *mini)
+{
+	if (mini) {
+		mini_journal_close(mini);
+		if (mini->map)
+			unmap_file(mini->map, mini->map_size);
+		/* Always on the heap, users may assign it by hand */
+		mem_free(mini->path);
+		mem_free(mini->synced_path);
+		if (mini->save_state) {
+			mutex_lock(&saver.lock);
+			save_state_release(mini->save_state);
+			mutex_unlock(&saver.lock);
+		}
+		if (mini->arena) {
+			/* Everything lives in the arena chunks */
+			arena_destroy(mini->arena);
+		} else {
+			free_group_children(mini, mini->head);
+			table_free(mini, &mini->groups);
+			table_free(mini, &mini->atoms);
+		}
+		mini->path = NULL;
+		mini->head = NULL;
+		mini->tail = NULL;
+		mini->arena = NULL;
+		mini->map = NULL;
+		mem_free(mini->stats);
+		mem_free(mini);
+	}
+}
+
+/* Takes v out of its group without freeing it */
+static void unlink_value(mini_t *mini, mini_group_t *grp, mini_value_t *v, unsigned int hash)
+{
+	if (v->next)
+		v->next->prev = v->prev;
+	if (v->prev)
+		v->prev->next = v->next;
+	if (v == grp->head)
+		grp->head = v->next;
+	if (v == grp->tail)
+		grp->tail = v->prev;
+	table_remove(&grp->values, v, hash);
+	mini->generation++;
+	mini->dirty = 1;
 }
 
 int mini_delete_value(mini_t *mini, const char *group, const char *id)
 {
 	if (!mini || !id)
 		return MINI_INVALID_ARG;
-	int result = MINI_OK;
+	int result = MINI_OK;
+	mini_group_t *grp = NULL;
+	mini_value_t *v = get_value(mini, group, id, &result, &grp);
+
+	if (v) {
+		unlink_value(mini, grp, v, mini_hash(id));
+		free_value(mini, grp, v);
+		if (mini->journal)
+			result = journal_append(mini, JOURNAL_DELETE_VALUE, group, id, NULL);
+	}
+	return result;
+}
+
+int mini_delete_group(mini_t *mini, const char *group)
+{
+	if (!mini || !group)
+		return MINI_INVALID_ARG;
+	int result = MINI_OK;
+	mini_group_t *grp = get_group(mini, group, 0);
+
+	if (grp) {
+		if (grp->next)
+			grp->next->prev = grp->prev;
+		if (grp->prev)
+			grp->prev->next = grp->next;
+		if (grp == mini->tail)
+			mini->tail = grp->prev;
+		table_remove(&mini->groups, grp, mini_hash(group));
+		free_group(mini, grp);
+		mini->generation++;
+		mini->dirty = 1;
+		if (mini->journal)
+			result = journal_append(mini, JOURNAL_DELETE_GROUP, group, NULL, NULL);
+	} else {
+		result = MINI_GROUP_NOT_FOUND;
+	}
+	return result;
+}
+
+int mini_value_exists(mini_t *mini, const char *group, const char *id)
+{
+	if (!mini || !id)
+		return MINI_INVALID_ARG;
+	int result = MINI_OK;
+	get_value(mini, group, id, &result, NULL);
+	return result;
+}
+
+/* Returns the node which now holds val */
+static mini_value_t *set_value(mini_t *mini, const char *group, const char *id, const char *val, int *result)
+{
+	mini_group_t *grp = NULL;
+	mini_value_t *v = get_value(mini, group, id, result, &grp);
+
+	if (v) {
+		if (block_owns(grp, v->val))
+			v->val = mini_stralloc(mini, val);
+		else
+			v->val = mini_strreplace(mini, v->val, val);
+		v->cached = 0;
+		mini->dirty = 1;
+	} else {
+		if (!grp)
+			grp = create_group(mini, group);
+		*result = add_value(mini, grp, id, val);
+		if (*result == MINI_OK)
+			v = grp->head;
+	}
+
+	if (v && mini->journal)
+		*result = journal_append(mini, JOURNAL_SET, group, id, val);
+	return v;
+}
+
+int mini_set_string(mini_t *mini, const char *group, const char *id, const char *val)
+{
+	if (!mini || !id)
+		return MINI_INVALID_ARG;
+	int result = MINI_OK;
+	set_value(mini, group, id, val, &result);
+	return result;
+}
+
+int mini_set_int(mini_t *mini, const char *group, const char *id, long long val)
+{
+	if (!mini || !id)
+		return MINI_INVALID_ARG;
+	char buf[MINI_NUMBER_SIZE];
+	int result = MINI_OK;
+	mini_format_int(buf, val);
+
+	/* The text is exactly what mini_get_int would parse */
+	mini_value_t *v = set_value(mini, group, id, buf, &result);
+	if (v) {
+		v->cached = MINI_CACHED_INT;
+		v->int_val = val;
+	}
+	return result;
+}
+
+int mini_set_double(mini_t *mini, const char *group, const char *id, double val)
+{
+	if (!mini || !id)
+		return MINI_INVALID_ARG;
+	char buf[MINI_NUMBER_SIZE];
+	int result = MINI_OK;
+	mini_format_double(buf, val);
+
+	/* The text reads back to exactly this value */
+	mini_value_t *v = set_value(mini, group, id, buf, &result);
+	if (v) {
+		v->cached = MINI_CACHED_DOUBLE;
+		v->double_val = val;
+	}
+	return result;
+}
+
+const char *mini_get_string_ex(mini_t *mini, const char *group, const char *id, const char *fallback, int *err)
+{
+	if (!mini || !id)
+		return fallback;
+	const char *result = fallback;
+
+	mini_value_t *v = get_value(mini, group, id, err, NULL);
+
+	if (v)
+		result = v->val;
+
+	return result;
+}
+
+/* Conversions are done once per value and kept until the value changes */
+static int parse_int(const char *str, long long *val)
+{
+	errno = 0;
+	*val = strtoimax(str, NULL, 10);
+	if ((*val == INTMAX_MAX || *val == INTMAX_MIN) && errno == ERANGE)
+		return MINI_CONVERSION_ERROR;
+	return MINI_OK;
+}
+
+static long long value_to_int(mini_value_t *v, long long fallback, int *err)
+{
+	if (!v)
+		return fallback;
+
+	if (!(v->cached & MINI_CACHED_INT)) {
+		v->cached |= MINI_CACHED_INT;
+		if (parse_int(v->val, &v->int_val) != MINI_OK)
+			v->cached |= MINI_CACHED_RANGE_ERROR;
+	}
+
+	if (v->cached & MINI_CACHED_RANGE_ERROR && err) {
+		*err = MINI_CONVERSION_ERROR;
+		return fallback;
+	}
+	return v->int_val;
+}
+
+static double value_to_double(mini_value_t *v, double fallback)
+{
+	if (!v)
+		return fallback;
+
+	if (!(v->cached & MINI_CACHED_DOUBLE)) {
+		v->double_val = mini_parse_double(v->val, NULL);
+		v->cached |= MINI_CACHED_DOUBLE;
+	}
+	return v->double_val;
+}
+
+long long mini_get_int_ex(mini_t *mini, const char *group, const char *id, long long fallback, int *err)
+{
+	if (!mini || !id)
+		return fallback;
+	return value_to_int(get_value(mini, group, id, err, NULL), fallback, err);
+}
+
+double mini_get_double_ex(mini_t *mini, const char *group, const char *id, double fallback, int *err)
+{
+	if (!mini || !id)
+		return fallback;
+	return value_to_double(get_value(mini, group, id, err, NULL), fallback);
+}
+
+/* === Key handles === */
+
+static void resolve_key(mini_t *mini, mini_key_t *key)
+{
+	mini_group_t *grp = mini->head;
+
+	key->value = NULL;
+	key->result = MINI_OK;
+	key->mini = mini;
+	key->instance = mini->instance;
+	key->generation = mini->generation;
+
+	if (key->group)
+		grp = table_find(&mini->groups, key->group, key->group_hash);
+
+	if (!grp)
+		key->result = MINI_GROUP_NOT_FOUND;
+	else if (!(key->value = table_find(&grp->values, key->id, key->hash)))
+		key->result = MINI_VALUE_NOT_FOUND;
+}
+
+/* Only touches the tables if something was added or removed since the
+ * key was last resolved, otherwise this is two compares */
+static mini_value_t *key_value(mini_t *mini, mini_key_t *key, int *err)
+{
+	if (!mini || !key || !key->id) {
+		if (err)
+			*err = MINI_INVALID_ARG;
+		return NULL;
+	}
+
+	if (key->mini != mini || key->instance != mini->instance || key->generation != mini->generation)
+		resolve_key(mini, key);
+
+	MINI_STAT_ADD(mini, lookups, 1);
+	if (key->value)
+		MINI_STAT_ADD(mini, hits, 1);
+	else if (key->result == MINI_GROUP_NOT_FOUND)
+		MINI_STAT_ADD(mini, group_misses, 1);
+	else
+		MINI_STAT_ADD(mini, value_misses, 1);
+
+	if (!key->value && err)
+		*err = key->result;
+	return key->value;
+}
+
+mini_key_t mini_resolve(mini_t *mini, const char *group, const char *id)
+{
+	mini_key_t key;
+	memset(&key, 0, sizeof(key));
+	key.group = group;
+	key.id = id;
+
+	if (group)
+		key.group_hash = mini_hash(group);
+	if (id)
+		key.hash = mini_hash(id);
+	if (mini && id)
+		resolve_key(mini, &key);
+	return key;
+}
+
+const char *mini_get_string_k(mini_t *mini, mini_key_t *key, const char *fallback, int *err)
+{
+	mini_value_t *v = key_value(mini, key, err);
+	return v ? v->val : fallback;
+}
+
+long long mini_get_int_k(mini_t *mini, mini_key_t *key, long long fallback, int *err)
+{
+	return value_to_int(key_value(mini, key, err), fallback, err);
+}
+
+double mini_get_double_k(mini_t *mini, mini_key_t *key, double fallback, int *err)
+{
+	return value_to_double(key_value(mini, key, err), fallback);
+}
+
+/* === Ordered iteration === */
+
+static mini_iter_t make_iter(mini_t *mini, mini_table_t *t, const char *from, const char *prefix, const char *to)
+{
+	mini_iter_t it;
+	memset(&it, 0, sizeof(it));
+	if (!mini || !t)
+		return it;
+
+	sorted_build(mini, t);
+	it.mini = mini;
+	it.table = t;
+	it.generation = mini->generation;
+	it.prefix = prefix;
+	it.prefix_len = prefix ? strlen(prefix) : 0;
+	it.to = to;
+	it.pos = from ? sorted_lower_bound(t, from) : 0;
+	return it;
+}
+
+mini_iter_t mini_iter_groups(mini_t *mini, const char *prefix)
+{
+	return make_iter(mini, mini ? &mini->groups : NULL, prefix, prefix, NULL);
+}
+
+mini_iter_t mini_iter_prefix(mini_t *mini, const char *group, const char *prefix)
+{
+	mini_group_t *grp = mini ? get_group(mini, group, 0) : NULL;
+	return make_iter(mini, grp ? &grp->values : NULL, prefix, prefix, NULL);
+}
+
+mini_iter_t mini_iter_range(mini_t *mini, const char *group, const char *from, const char *to)
+{
+	mini_group_t *grp = mini ? get_group(mini, group, 0) : NULL;
+	return make_iter(mini, grp ? &grp->values : NULL, from, NULL, to);
+}
+
+int mini_iter_next(mini_iter_t *it)
+{
+	/* Ends early if anything was added or removed in the meantime */
+	if (!it || !it->table || it->generation != it->mini->generation || it->pos >= it->table->count)
+		return 0;
+
+	void *node = it->table->sorted[it->pos];
+	const char *id = node_id(node);
+	if (it->prefix && strncmp(id, it->prefix, it->prefix_len) != 0)
+		return 0;
+	if (it->to && strcmp(id, it->to) >= 0)
+		return 0;
+
+	it->pos++;
+	it->id = id;
+	it->val = it->table == &it->mini->groups ? NULL : ((mini_value_t *)node)->val;
+	return 1;
+}
+
+/* === Overlays === */
+
+/* Entries after which the cache starts over, so lookups of ever new
+ * missing keys can't grow it without bound */
+#define OVERLAY_CACHE_MAX 16384
+
+/* Cache entry for one looked up key, value points into a layer */
+typedef struct overlay_value_s {
+	char *id;
+	mini_value_t *value;
+	int result; /* Error code if value is NULL */
+} overlay_value_t;
+
+struct mini_overlay_s {
+	mini_t **layers;                  /* Bottom first                      */
+	unsigned long long *generations;  /* Of each layer when cache was built */
+	int count;
+	mini_t *cache;     /* Groups hold overlay_value_t, NULL without caching */
+	int cache_entries; /* Held by cache                                     */
+};
+
+mini_overlay_t *mini_overlay_create(mini_t *const *layers, int count, int cache)
+{
+	if (!layers || count < 1)
+		return NULL;
+	for (int i = 0; i < count; i++) {
+		if (!layers[i])
+			return NULL;
+	}
+
+	mini_overlay_t *ov = mem_alloc(sizeof(mini_overlay_t));
+	ov->layers = mem_alloc(count * sizeof(mini_t *));
+	ov->generations = mem_calloc(count, sizeof(unsigned long long));
+	ov->count = count;
+	memcpy(ov->layers, layers, count * sizeof(mini_t *));
+
+	/* The cache is only ever dropped as a whole, which the arena does at once */
+	ov->cache = cache ? create_mini(NULL, 1) : NULL;
+	ov->cache_entries = 0;
+	for (int i = 0; i < count; i++)
+		ov->generations[i] = layers[i]->generation;
+	return ov;
+}
+
+void mini_overlay_free(mini_overlay_t *overlay)
+{
+	if (overlay) {
+		mini_free(overlay->cache);
+		mem_free(overlay->generations);
+		mem_free(overlay->layers);
+		mem_free(overlay);
+	}
+}
+
+/* Walks the layers top down, result is set like err in get_value */
+static mini_value_t *overlay_resolve(const mini_overlay_t *ov, const char *group, unsigned int group_hash,
+                                     const char *id, unsigned int hash, int *result)
+{
+	*result = MINI_GROUP_NOT_FOUND;
+	for (int i = ov->count - 1; i >= 0; i--) {
+		const mini_t *layer = ov->layers[i];
+		const mini_group_t *grp = group ? table_find(&layer->groups, group, group_hash) : layer->head;
+		if (!grp)
+			continue;
+
+		mini_value_t *v = table_find(&grp->values, id, hash);
+		if (v) {
+			*result = MINI_OK;
+			return v;
+		}
+		*result = MINI_VALUE_NOT_FOUND;
+	}
+	return NULL;
+}
+
+static void overlay_reset(mini_overlay_t *ov)
+{
+	mini_free(ov->cache);
+	ov->cache = create_mini(NULL, 1);
+	ov->cache_entries = 0;
+}
+
+static int overlay_has_group(const mini_overlay_t *ov, const char *group, unsigned int group_hash)
+{
+	for (int i = 0; i < ov->count; i++) {
+		if (table_find(&ov->layers[i]->groups, group, group_hash))
+			return 1;
+	}
+	return 0;
+}
+
+/* Drops the cache if values or groups came or went in any layer.
+ * Changed values need no check since entries point to the layer nodes */
+static void overlay_validate(mini_overlay_t *ov)
+{
+	int valid = 1;
+	for (int i = 0; i < ov->count; i++) {
+		if (ov->generations[i] != ov->layers[i]->generation) {
+			ov->generations[i] = ov->layers[i]->generation;
+			valid = 0;
+		}
+	}
+
+	if (!valid || ov->cache_entries >= OVERLAY_CACHE_MAX)
+		overlay_reset(ov);
+}
+
+static mini_value_t *overlay_value(mini_overlay_t *ov, const char *group, const char *id, int *err)
+{
+	if (!ov || !id) {
+		if (err)
+			*err = MINI_INVALID_ARG;
+		return NULL;
+	}
+
+	const unsigned int group_hash = group ? mini_hash(group) : 0;
+	const unsigned int hash = mini_hash(id);
+	mini_value_t *v;
+	int result;
+
+	if (ov->cache)
+		overlay_validate(ov);
+	mini_group_t *grp = ov->cache ? get_group(ov->cache, group, 0) : NULL;
+
+	/* Groups no layer has aren't cached, every such lookup would add one */
+	if (!grp && ov->cache && overlay_has_group(ov, group, group_hash))
+		grp = get_group(ov->cache, group, 1);
+
+	if (grp) {
+		overlay_value_t *e = table_find(&grp->values, id, hash);
+		if (!e) {
+			e = mini_alloc(ov->cache, sizeof(overlay_value_t));
+			e->id = mini_stralloc(ov->cache, id);
+			e->value = overlay_resolve(ov, group, group_hash, id, hash, &e->result);
+			table_insert(ov->cache, &grp->values, e, hash);
+			ov->cache_entries++;
+		}
+		v = e->value;
+		result = e->result;
+	} else {
+		v = overlay_resolve(ov, group, group_hash, id, hash, &result);
+	}
+
+	if (!v && err)
+		*err = result;
+	return v;
+}
+
+const char *mini_overlay_get_string_ex(mini_overlay_t *overlay, const char *group, const char *id,
+                                       const char *fallback, int *err)
+{
+	mini_value_t *v = overlay_value(overlay, group, id, err);
+	return v ? v->val : fallback;
+}
+
+long long mini_overlay_get_int_ex(mini_overlay_t *overlay, const char *group, const char *id, long long fallback,
+                                  int *err)
+{
+	return value_to_int(overlay_value(overlay, group, id, err), fallback, err);
+}
+
+double mini_overlay_get_double_ex(mini_overlay_t *overlay, const char *group, const char *id, double fallback,
+                                  int *err)
+{
+	return value_to_double(overlay_value(overlay, group, id, err), fallback);
+}
+
+/* One pass over all layers from the top, every value is copied only if
+ * no layer above already provided it */
+mini_t *mini_overlay_flatten(const mini_overlay_t *overlay)
+{
+	if (!overlay)
+		return NULL;
+
+	mini_t *result = mini_create(NULL);
+	for (int i = overlay->count - 1; i >= 0; i--) {
+		for (const mini_group_t *g = overlay->layers[i]->head; g; g = g->next) {
+			mini_group_t *target = get_group(result, g->id, 1);
+			for (const mini_value_t *v = g->tail; v; v = v->prev) {
+				const unsigned int hash = mini_hash(v->id);
+				if (table_find(&target->values, v->id, hash))
+					continue;
+
+				link_value(result, target, mini_intern(result, v->id, hash), mini_stralloc(result, v->val), hash);
+				target->head->cached = v->cached;
+				target->head->int_val = v->int_val;
+				target->head->double_val = v->double_val;
+			}
+		}
+	}
+	return result;
+}
+
+/* === Packing === */
+
+/* Copies the values of grp into a new block, oldest first, so that
+ * following prev from the tail walks the block front to back */
+static void pack_group(mini_t *mini, mini_group_t *grp)
+{
+	const size_t count = grp->values.count;
+	mini_block_t *old = grp->block;
+	mini_value_t *v, *prev;
+	size_t size = sizeof(mini_block_t) + count * sizeof(mini_value_t);
+
+	if (!count)
+		return;
+	for (v = grp->tail; v; v = v->prev)
+		size += strlen(v->val) + 1;
+
+	mini_block_t *block = mini_alloc(mini, size);
+	mini_value_t *nodes = (mini_value_t *)(block + 1);
+	char *str = (char *)(nodes + count);
+	size_t n = 0;
+	block->size = size;
+	block->live = count;
+
+	/* The old node's next remembers its copy until the index is updated */
+	for (v = grp->tail; v; v = v->prev, n++) {
+		const size_t len = strlen(v->val) + 1;
+		nodes[n] = *v;
+		nodes[n].val = memcpy(str, v->val, len);
+		nodes[n].next = n ? &nodes[n - 1] : NULL;
+		nodes[n].prev = n + 1 < count ? &nodes[n + 1] : NULL;
+		v->next = &nodes[n];
+		str += len;
+	}
+
+	mini_table_t *t = &grp->values;
+	for (size_t i = 0; i <= t->mask; i++) {
+		if (t->slots[i].node)
+			t->slots[i].node = ((mini_value_t *)t->slots[i].node)->next;
+	}
+	/* A stale view may hold nodes which are gone already */
+	for (size_t i = 0; t->sorted && !t->sorted_stale && i < t->count; i++)
+		t->sorted[i] = ((mini_value_t *)t->sorted[i])->next;
+
+	/* The ids moved over, everything else of the old nodes goes */
+	for (v = grp->tail; v; v = prev) {
+		prev = v->prev;
+		if (!block_owns(grp, v->val))
+			mini_strfree(mini, v->val);
+		if (!block_owns(grp, v))
+			mini_release(mini, v, sizeof(mini_value_t));
+	}
+	if (old)
+		mini_release(mini, old, old->size);
+
+	grp->block = block;
+	grp->tail = nodes;
+	grp->head = &nodes[count - 1];
+}
+
+int mini_pack(mini_t *mini)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+
+	for (mini_group_t *grp = mini->head; grp; grp = grp->next)
+		pack_group(mini, grp);
+	mini->generation++;
+	return MINI_OK;
+}
+
+/* === Batches === */
+
+#define BATCH_NONE ((size_t)-1) /* Offset of a missing group or value */
+
+typedef struct batch_op_s {
+	const char *group; /* Set from the offsets before sorting */
+	const char *id;
+	const char *val;   /* NULL for deletes */
+	size_t group_at;   /* Offsets into the string buffer */
+	size_t id_at;
+	size_t val_at;
+	size_t seq;        /* Keeps operations on the same value in order */
+} batch_op_t;
+
+enum batch_change {
+	BATCH_CHANGED,
+	BATCH_ADDED,
+	BATCH_REMOVED,
+};
+
+/* Enough to take back one change */
+typedef struct batch_undo_s {
+	int change;
+	mini_group_t *grp;
+	mini_value_t *v;    /* Unlinked but not freed for BATCH_REMOVED */
+	char *old;          /* Previous value for BATCH_CHANGED */
+	mini_value_t *prev; /* Neighbours of v before BATCH_REMOVED */
+	mini_value_t *next;
+	unsigned int hash;
+} batch_undo_t;
+
+struct mini_batch_s {
+	mini_t *mini;
+	batch_op_t *ops;
+	size_t count;
+	size_t size;
+	out_buffer_t strings;
+	batch_undo_t *undo;
+	size_t undo_count;
+	mini_group_t **created; /* Groups the batch had to add */
+	size_t created_count;
+};
+
+mini_batch_t *mini_batch_begin(mini_t *mini)
+{
+	if (!mini)
+		return NULL;
+	mini_batch_t *batch = mem_calloc(1, sizeof(mini_batch_t));
+	if (batch)
+		batch->mini = mini;
+	return batch;
+}
+
+static size_t batch_string(mini_batch_t *batch, const char *str)
+{
+	const size_t at = batch->strings.len;
+	buffer_append(&batch->strings, str, strlen(str) + 1);
+	return at;
+}
+
+static int batch_add(mini_batch_t *batch, const char *group, const char *id, const char *val)
+{
+	if (!batch || !id)
+		return MINI_INVALID_ARG;
+
+	if (batch->count == batch->size) {
+		const size_t size = batch->size ? batch->size * 2 : 64;
+		batch_op_t *ops = mem_realloc(batch->ops, size * sizeof(batch_op_t));
+		if (!ops)
+			return MINI_OUT_OF_MEMORY;
+		batch->ops = ops;
+		batch->size = size;
+	}
+
+	batch_op_t *op = &batch->ops[batch->count];
+	op->group_at = group ? batch_string(batch, group) : BATCH_NONE;
+	op->id_at = batch_string(batch, id);
+	op->val_at = val ? batch_string(batch, val) : BATCH_NONE;
+	if (batch->strings.failed)
+		return MINI_OUT_OF_MEMORY;
+	op->seq = batch->count++;
+	return MINI_OK;
+}
+
+int mini_batch_set(mini_batch_t *batch, const char *group, const char *id, const char *val)
+{
+	return val ? batch_add(batch, group, id, val) : MINI_INVALID_ARG;
+}
+
+int mini_batch_delete(mini_batch_t *batch, const char *group, const char *id)
+{
+	return batch_add(batch, group, id, NULL);
+}
+
+static void batch_free(mini_batch_t *batch)
+{
+	mem_free(batch->ops);
+	mem_free(batch->strings.data);
+	mem_free(batch->undo);
+	mem_free(batch->created);
+	mem_free(batch);
+}
+
+void mini_batch_abort(mini_batch_t *batch)
+{
+	if (batch)
+		batch_free(batch);
+}
+
+/* By group with the root first, then id, then order of recording */
+static int batch_compare(const void *a, const void *b)
+{
+	const batch_op_t *x = a, *y = b;
+	int c = 0;
+
+	if (x->group != y->group)
+		c = !x->group ? -1 : !y->group ? 1 : strcmp(x->group, y->group);
+	if (c == 0)
+		c = strcmp(x->id, y->id);
+	if (c == 0)
+		c = x->seq < y->seq ? -1 : x->seq > y->seq;
+	return c;
+}
+
+static int same_group(const batch_op_t *a, const batch_op_t *b)
+{
+	return a->group == b->group || (a->group && b->group && strcmp(a->group, b->group) == 0);
+}
+
+/* End of the run of operations on the same value as ops[i] */
+static size_t batch_run(const mini_batch_t *batch, size_t i)
+{
+	size_t j = i + 1;
+	while (j < batch->count && same_group(&batch->ops[i], &batch->ops[j]) &&
+	       strcmp(batch->ops[i].id, batch->ops[j].id) == 0)
+		j++;
+	return j;
+}
+
+/* Sorts the operations and makes sure every delete will find its value */
+static int batch_prepare(mini_batch_t *batch)
+{
+	const char *strings = batch->strings.data;
 	mini_group_t *grp = NULL;
-	mini_value_t *v = get_value(mini, group, id, &result, &grp);
 
-	if (v) {
-		if (v->next)
-			v->next->prev = v->prev;
-		if (v->prev)
-			v->prev->next = v->next;
-		if (v == grp->head)
-			grp->head = v->next;
-		if (v == grp->tail)
-			grp->tail = v->prev;
-		free_value(v);
+	if (batch->strings.failed)
+		return MINI_OUT_OF_MEMORY;
+
+	for (size_t i = 0; i < batch->count; i++) {
+		batch_op_t *op = &batch->ops[i];
+		op->group = op->group_at != BATCH_NONE ? strings + op->group_at : NULL;
+		op->id = strings + op->id_at;
+		op->val = op->val_at != BATCH_NONE ? strings + op->val_at : NULL;
 	}
-	return result;
+	if (batch->count)
+		qsort(batch->ops, batch->count, sizeof(batch_op_t), batch_compare);
+
+	for (size_t i = 0, end; i < batch->count; i = end) {
+		const batch_op_t *op = &batch->ops[i];
+		if (i == 0 || !same_group(&batch->ops[i - 1], op))
+			grp = get_group(batch->mini, op->group, 0);
+
+		int exists = grp && table_find(&grp->values, op->id, mini_hash(op->id));
+		end = batch_run(batch, i);
+		for (size_t k = i; k < end; k++) {
+			if (!batch->ops[k].val && !exists)
+				return grp ? MINI_VALUE_NOT_FOUND : MINI_GROUP_NOT_FOUND;
+			exists = batch->ops[k].val != NULL;
+		}
+	}
+
+	batch->undo = mem_alloc((batch->count + 1) * sizeof(batch_undo_t));
+	batch->created = mem_alloc((batch->count + 1) * sizeof(mini_group_t *));
+	return batch->undo && batch->created ? MINI_OK : MINI_OUT_OF_MEMORY;
 }
 
-int mini_delete_group(mini_t *mini, const char *group)
+/* Looks up every group and value once and applies the last operation on it */
+static void batch_apply(mini_batch_t *batch)
 {
-	if (!mini)
-		return MINI_INVALID_ARG;
-	int result = MINI_OK;
-	char *tmp = mini_strdup(group);
-	mini_group_t *grp = get_group(mini, tmp, 0);
-	free(tmp);
+	mini_t *mini = batch->mini;
+	mini_group_t *grp = NULL;
 
-	if (grp) {
-		free_group_children(grp);
-		if (grp->next)
-			grp->next->prev = grp->prev;
-		if (grp->prev)
-			grp->prev->next = grp->next;
-		free_group(grp);
-	} else {
-		result = MINI_GROUP_NOT_FOUND;
+	for (size_t i = 0, end; i < batch->count; i = end) {
+		end = batch_run(batch, i);
+		const batch_op_t *op = &batch->ops[end - 1];
+		if (i == 0 || !same_group(&batch->ops[i - 1], op))
+			grp = get_group(mini, op->group, 0);
+		if (!grp && op->val) {
+			grp = create_group(mini, op->group);
+			batch->created[batch->created_count++] = grp;
+		}
+		if (!grp)
+			continue;
+
+		batch_undo_t *u = &batch->undo[batch->undo_count];
+		u->grp = grp;
+		u->hash = mini_hash(op->id);
+		u->v = table_find(&grp->values, op->id, u->hash);
+
+		if (op->val && u->v) {
+			u->change = BATCH_CHANGED;
+			u->old = u->v->val;
+			u->v->val = mini_stralloc(mini, op->val);
+			u->v->cached = 0;
+			mini->dirty = 1;
+		} else if (op->val) {
+			u->change = BATCH_ADDED;
+			link_value(mini, grp, mini_intern(mini, op->id, u->hash), mini_stralloc(mini, op->val), u->hash);
+			u->v = grp->head;
+		} else if (u->v) {
+			u->change = BATCH_REMOVED;
+			u->prev = u->v->prev;
+			u->next = u->v->next;
+			unlink_value(mini, grp, u->v, u->hash);
+		} else {
+			/* Added and deleted again within the batch */
+			continue;
+		}
+		batch->undo_count++;
 	}
-	return result;
 }
 
-int mini_value_exists(mini_t *mini, const char *group, const char *id)
+/* Appends a record for every applied change with a single write, which
+ * replays to the same values in the same order as batch_apply left them */
+static int batch_journal(mini_batch_t *batch)
 {
-	if (!mini || !id)
-		return MINI_INVALID_ARG;
-	int result = MINI_OK;
-	get_value(mini, group, id, &result, NULL);
-	return result;
+	mini_t *mini = batch->mini;
+	mini_journal_t *j = mini->journal;
+
+	if (j->failed)
+		return mini_compact(mini);
+
+	j->record.len = 0;
+	for (size_t i = 0; i < batch->undo_count; i++) {
+		const batch_undo_t *u = &batch->undo[i];
+		const char *group = u->grp == mini->head ? NULL : u->grp->id;
+		if (u->change == BATCH_REMOVED)
+			journal_record(&j->record, JOURNAL_DELETE_VALUE, group, u->v->id, NULL);
+		else
+			journal_record(&j->record, JOURNAL_SET, group, u->v->id, u->v->val);
+	}
+	return journal_write(j);
 }
 
-int mini_set_string(mini_t *mini, const char *group, const char *id, const char *val)
+/* Releases what the applied changes replaced */
+static void batch_finish(mini_batch_t *batch)
 {
-	if (!mini || !id)
+	for (size_t i = 0; i < batch->undo_count; i++) {
+		batch_undo_t *u = &batch->undo[i];
+		if (u->change == BATCH_CHANGED && !block_owns(u->grp, u->old))
+			mini_strfree(batch->mini, u->old);
+		else if (u->change == BATCH_REMOVED)
+			free_value(batch->mini, u->grp, u->v);
+	}
+}
+
+/* Puts a removed value back between its old neighbours, which are
+ * linked again since later changes are taken back first */
+static void batch_relink(mini_t *mini, const batch_undo_t *u)
+{
+	mini_value_t *v = u->v;
+	v->prev = u->prev;
+	v->next = u->next;
+	if (v->prev)
+		v->prev->next = v;
+	else
+		u->grp->head = v;
+	if (v->next)
+		v->next->prev = v;
+	else
+		u->grp->tail = v;
+	table_insert(mini, &u->grp->values, v, u->hash);
+	mini->generation++;
+}
+
+static void batch_rollback(mini_batch_t *batch)
+{
+	mini_t *mini = batch->mini;
+
+	for (size_t i = batch->undo_count; i-- > 0;) {
+		batch_undo_t *u = &batch->undo[i];
+		if (u->change == BATCH_CHANGED) {
+			mini_strfree(mini, u->v->val);
+			u->v->val = u->old;
+			u->v->cached = 0;
+		} else if (u->change == BATCH_ADDED) {
+			unlink_value(mini, u->grp, u->v, u->hash);
+			free_value(mini, u->grp, u->v);
+		} else {
+			batch_relink(mini, u);
+		}
+	}
+
+	for (size_t i = batch->created_count; i-- > 0;)
+		mini_delete_group(mini, batch->created[i]->id);
+}
+
+int mini_batch_commit(mini_batch_t *batch, int flags)
+{
+	if (!batch)
 		return MINI_INVALID_ARG;
-	int result = MINI_OK;
-	mini_group_t *grp = NULL;
-	mini_value_t *v = get_value(mini, group, id, &result, &grp);
 
-	if (v) {
-		free(v->val);
-		v->val = mini_strdup(val);
-	} else {
-		if (!grp)
-			grp = create_group(mini, group);
-		result = add_value(grp, id, val);
+	mini_t *mini = batch->mini;
+	mini_journal_t *journal = mini->journal;
+	const int dirty = mini->dirty;
+	int result = batch_prepare(batch);
+
+	if (result == MINI_OK) {
+		/* Journaled in one write below instead of a record per change */
+		mini->journal = NULL;
+		batch_apply(batch);
+
+		if (journal || flags & MINI_FLAGS_SAVE) {
+			mini->journal = journal;
+			/* A failed plain save truncates the file, which no rollback undoes */
+			result = journal ? batch_journal(batch) : mini_save(mini, flags | MINI_FLAGS_ATOMIC);
+			mini->journal = NULL;
+		}
+
+		if (result == MINI_OK) {
+			batch_finish(batch);
+		} else {
+			batch_rollback(batch);
+			mini->dirty = dirty;
+		}
+		mini->journal = journal;
+
+		/* The batch is in the journal already, a failed compaction is
+		 * tried again with the next change */
+		if (result == MINI_OK && journal && journal_full(journal))
+			mini_compact(mini);
 	}
 
+	batch_free(batch);
 	return result;
 }
 
-int mini_set_int(mini_t *mini, const char *group, const char *id, long long val)
+/* === Snapshots === */
+
+/* A snapshot is one block holding a header, the groups, a hash index of
+ * the groups, the values of all groups, one hash index per group and the
+ * strings. Everything refers to other parts by offset from the start of
+ * the block. Group 0 is the root group, it isn't in the group index */
+#define SNAP_MAGIC 0x494e494d /* "MINI" */
+#define SNAP_VERSION 1
+
+typedef struct snap_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;        /* Of the whole image                  */
+	uint32_t group_count;
+	uint32_t value_count;
+	uint32_t groups;      /* Offset of the snap_group_t array    */
+	uint32_t group_slots; /* Offset of the group index           */
+	uint32_t group_mask;  /* Group index slot count - 1          */
+	uint32_t values;      /* Offset of the snap_value_t array    */
+	uint32_t value_slots; /* Offset of the value indices         */
+} snap_header_t;
+
+typedef struct snap_group_s {
+	uint32_t id;    /* String offset, 0 for the root group     */
+	uint32_t first; /* Index of the first value of this group  */
+	uint32_t count;
+	uint32_t slots; /* Index of the first slot of its index    */
+	uint32_t mask;
+} snap_group_t;
+
+typedef struct snap_value_s {
+	uint32_t id;
+	uint32_t val;
+} snap_value_t;
+
+typedef struct snap_slot_s {
+	uint32_t hash;
+	uint32_t index; /* Group/value index + 1, 0 if empty */
+} snap_slot_t;
+
+struct mini_snapshot_s {
+	mini_atomic_t refs;
+	const char *image;
+	char *map;       /* File mapping from mini_load_binary, NULL  */
+	size_t map_size; /* if the image was built by mini_freeze     */
+};
+
+/* Hash indices are kept at most half full */
+static uint32_t snap_slot_count(uint32_t count)
 {
-	char buf[57];
-	snprintf(buf, 56, "%lli", val);
-	return mini_set_string(mini, group, id, buf);
+	uint32_t slots = 1;
+	while (slots < count * 2)
+		slots <<= 1;
+	return slots;
 }
 
-int mini_set_double(mini_t *mini, const char *group, const char *id, double val)
+static void snap_insert(snap_slot_t *slots, uint32_t mask, uint32_t hash, uint32_t index)
 {
-	char buf[64];
-	snprintf(buf, 56, "%lf", val);
-	return mini_set_string(mini, group, id, buf);
+	uint32_t i = hash & mask;
+	while (slots[i].index)
+		i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].index = index + 1;
 }
 
-const char *mini_get_string_ex(mini_t *mini, const char *group, const char *id, const char *fallback, int *err)
+static uint32_t snap_string(char *image, uint32_t *pos, const char *str)
 {
-	if (!mini || !id)
-		return fallback;
-	const char *result = fallback;
+	const uint32_t offset = *pos;
+	const size_t len = strlen(str) + 1;
+	memcpy(image + offset, str, len);
+	*pos += (uint32_t)len;
+	return offset;
+}
 
-	mini_value_t *v = get_value(mini, group, id, err, NULL);
+/* Builds the image of a mini_t, NULL if it doesn't fit into 4 GiB */
+static char *snap_build(const mini_t *mini, size_t *size)
+{
+	uint32_t group_count = 0, value_count = 0, value_slots = 0;
+	size_t strings = 0;
 
-	if (v)
-		result = v->val;
+	for (const mini_group_t *g = mini->head; g; g = g->next) {
+		uint32_t count = 0;
+		if (g->id)
+			strings += strlen(g->id) + 1;
+		for (const mini_value_t *v = g->head; v; v = v->next, count++)
+			strings += strlen(v->id) + strlen(v->val) + 2;
+		group_count++;
+		value_count += count;
+		value_slots += snap_slot_count(count);
+	}
 
-	return result;
+	const uint32_t group_slots = snap_slot_count(group_count);
+	snap_header_t h = {SNAP_MAGIC, SNAP_VERSION, 0, group_count, value_count, 0, 0, group_slots - 1, 0, 0};
+	size_t total = sizeof(snap_header_t);
+	h.groups = (uint32_t)total;
+	total += group_count * sizeof(snap_group_t);
+	h.group_slots = (uint32_t)total;
+	total += group_slots * sizeof(snap_slot_t);
+	h.values = (uint32_t)total;
+	total += (size_t)value_count * sizeof(snap_value_t);
+	h.value_slots = (uint32_t)total;
+	total += (size_t)value_slots * sizeof(snap_slot_t);
+	total += strings;
+	if (total > UINT32_MAX)
+		return NULL;
+	h.size = (uint32_t)total;
+
+	char *image = mem_alloc(total);
+	if (!image)
+		return NULL;
+	memset(image, 0, h.value_slots + value_slots * sizeof(snap_slot_t));
+	memcpy(image, &h, sizeof(h));
+
+	snap_group_t *groups = (snap_group_t *)(image + h.groups);
+	snap_slot_t *gslots = (snap_slot_t *)(image + h.group_slots);
+	snap_value_t *values = (snap_value_t *)(image + h.values);
+	snap_slot_t *vslots = (snap_slot_t *)(image + h.value_slots);
+	uint32_t pos = h.value_slots + value_slots * sizeof(snap_slot_t);
+	uint32_t gi = 0, vi = 0, si = 0;
+
+	for (const mini_group_t *g = mini->head; g; g = g->next, gi++) {
+		snap_group_t *sg = &groups[gi];
+		sg->id = g->id ? snap_string(image, &pos, g->id) : 0;
+		sg->first = vi;
+		if (g->id)
+			snap_insert(gslots, h.group_mask, mini_hash(g->id), gi);
+
+		/* Values are stored in file order, which is the reverse of the list */
+		for (const mini_value_t *v = g->tail; v; v = v->prev, vi++) {
+			values[vi].id = snap_string(image, &pos, v->id);
+			values[vi].val = snap_string(image, &pos, v->val);
+		}
+		sg->count = vi - sg->first;
+		sg->slots = si;
+		sg->mask = snap_slot_count(sg->count) - 1;
+		for (uint32_t i = sg->first; i < vi; i++)
+			snap_insert(vslots + si, sg->mask, mini_hash(image + values[i].id), i - sg->first);
+		si += sg->mask + 1;
+	}
+
+	*size = total;
+	return image;
 }
 
-long long mini_get_int_ex(mini_t *mini, const char *group, const char *id, long long fallback, int *err)
+static const snap_group_t *snap_find_group(const char *image, const char *group)
 {
-	const char *val = mini_get_string_ex(mini, group, id, NULL, err);
-	if (!val)
-		return fallback;
-	long long res = strtoimax(val, NULL, 10);
-	if ((res == INTMAX_MAX || res == INTMAX_MIN) && errno == ERANGE && err) {
-		*err = MINI_CONVERSION_ERROR;
-		res = fallback;
+	const snap_header_t *h = (const snap_header_t *)image;
+	const snap_group_t *groups = (const snap_group_t *)(image + h->groups);
+
+	if (!group)
+		return groups;
+
+	const snap_slot_t *slots = (const snap_slot_t *)(image + h->group_slots);
+	const uint32_t hash = mini_hash(group);
+	uint32_t i = hash & h->group_mask;
+
+	while (slots[i].index) {
+		const snap_group_t *g = &groups[slots[i].index - 1];
+		if (slots[i].hash == hash && strcmp(image + g->id, group) == 0)
+			return g;
+		i = (i + 1) & h->group_mask;
 	}
-	return res;
+	return NULL;
 }
 
-double mini_get_double_ex(mini_t *mini, const char *group, const char *id, double fallback, int *err)
+/* Returns the value string or NULL, err works like in get_value */
+static const char *snap_find_value(const mini_snapshot_t *snap, const char *group, const char *id, int *err)
+{
+	if (!snap || !id) {
+		if (err)
+			*err = MINI_INVALID_ARG;
+		return NULL;
+	}
+
+	const char *image = snap->image;
+	const snap_group_t *g = snap_find_group(image, group);
+	if (!g) {
+		if (err)
+			*err = MINI_GROUP_NOT_FOUND;
+		return NULL;
+	}
+
+	const snap_header_t *h = (const snap_header_t *)image;
+	const snap_value_t *values = (const snap_value_t *)(image + h->values) + g->first;
+	const snap_slot_t *slots = (const snap_slot_t *)(image + h->value_slots) + g->slots;
+	const uint32_t hash = mini_hash(id);
+	uint32_t i = hash & g->mask;
+
+	while (slots[i].index) {
+		const snap_value_t *v = &values[slots[i].index - 1];
+		if (slots[i].hash == hash && strcmp(image + v->id, id) == 0)
+			return image + v->val;
+		i = (i + 1) & g->mask;
+	}
+
+	if (err)
+		*err = MINI_VALUE_NOT_FOUND;
+	return NULL;
+}
+
+mini_snapshot_t *mini_freeze(const mini_t *mini)
+{
+	if (!mini)
+		return NULL;
+
+	size_t size;
+	char *image = snap_build(mini, &size);
+	if (!image)
+		return NULL;
+
+	mini_snapshot_t *snap = mem_alloc(sizeof(mini_snapshot_t));
+	snap->refs = 1;
+	snap->image = image;
+	snap->map = NULL;
+	snap->map_size = 0;
+	return snap;
+}
+
+void mini_snapshot_retain(mini_snapshot_t *snap)
+{
+	if (snap)
+		mini_atomic_add(&snap->refs, 1);
+}
+
+void mini_snapshot_release(mini_snapshot_t *snap)
+{
+	if (snap && mini_atomic_add(&snap->refs, -1) == 0) {
+		if (snap->map)
+			unmap_file(snap->map, snap->map_size);
+		else
+			mem_free((char *)snap->image);
+		mem_free(snap);
+	}
+}
+
+const char *mini_snapshot_get_string_ex(const mini_snapshot_t *snap, const char *group, const char *id,
+                                        const char *fallback, int *err)
+{
+	const char *val = snap_find_value(snap, group, id, err);
+	return val ? val : fallback;
+}
+
+long long mini_snapshot_get_int_ex(const mini_snapshot_t *snap, const char *group, const char *id, long long fallback,
+                                   int *err)
 {
-	const char *val = mini_get_string_ex(mini, group, id, NULL, err);
+	const char *val = snap_find_value(snap, group, id, err);
+	long long result;
+
 	if (!val)
 		return fallback;
-	double res = 0;
-#if WIN32
-	sscanf_s(val, "%lf", &res);
-#else
-	sscanf(val, "%lf", &res);
-#endif
+	if (parse_int(val, &result) != MINI_OK) {
+		if (err)
+			*err = MINI_CONVERSION_ERROR;
+		return fallback;
+	}
+	return result;
+}
+
+double mini_snapshot_get_double_ex(const mini_snapshot_t *snap, const char *group, const char *id, double fallback,
+                                   int *err)
+{
+	const char *val = snap_find_value(snap, group, id, err);
+	return val ? mini_parse_double(val, NULL) : fallback;
+}
+
+/* Readers announce themselves in one of two counters, picked by the
+ * parity of epoch. A publisher swaps the pointer, flips the epoch and
+ * waits for the counter of the previous epoch to drain. After that no
+ * reader can still be about to take a reference to the old snapshot */
+struct mini_shared_s {
+	void *volatile current;
+	mini_atomic_t epoch;
+	mini_atomic_t readers[2];
+	mini_atomic_t writing; /* Publishers take turns */
+};
+
+mini_shared_t *mini_shared_create(mini_snapshot_t *snap)
+{
+	mini_shared_t *shared = mem_alloc(sizeof(mini_shared_t));
+	memset(shared, 0, sizeof(mini_shared_t));
+	shared->current = snap;
+	return shared;
+}
+
+mini_snapshot_t *mini_shared_acquire(mini_shared_t *shared)
+{
+	if (!shared)
+		return NULL;
+
+	long epoch;
+	mini_atomic_t *readers;
 
-	return res;
+	for (;;) {
+		epoch = mini_atomic_load(&shared->epoch);
+		readers = &shared->readers[epoch & 1];
+		mini_atomic_add(readers, 1);
+		/* A publisher flipped the epoch in between and may not wait for us */
+		if (mini_atomic_load(&shared->epoch) == epoch)
+			break;
+		mini_atomic_add(readers, -1);
+	}
+
+	mini_snapshot_t *snap = mini_atomic_load_ptr(&shared->current);
+	mini_snapshot_retain(snap);
+	mini_atomic_add(readers, -1);
+	return snap;
+}
+
+void mini_shared_publish(mini_shared_t *shared, mini_snapshot_t *snap)
+{
+	if (!shared)
+		return;
+
+	while (mini_atomic_swap(&shared->writing, 1))
+		thread_yield();
+
+	mini_snapshot_t *old = mini_atomic_swap_ptr(&shared->current, snap);
+	const long epoch = mini_atomic_add(&shared->epoch, 1) - 1;
+	while (mini_atomic_load(&shared->readers[epoch & 1]) != 0)
+		thread_yield();
+
+	mini_atomic_swap(&shared->writing, 0);
+	mini_snapshot_release(old);
+}
+
+void mini_shared_free(mini_shared_t *shared)
+{
+	if (shared) {
+		mini_snapshot_release(shared->current);
+		mem_free(shared);
+	}
+}
+
+/* === Binary files === */
+
+/* A binary file is a snapshot image as it is, which is little endian */
+static int snap_little_endian(void)
+{
+	const uint32_t one = 1;
+	return *(const char *)&one == 1;
+}
+
+/* The header and the layout it describes */
+static int snap_check(const char *image, size_t size)
+{
+	const snap_header_t *h = (const snap_header_t *)image;
+
+	if (size < sizeof(snap_header_t) || h->magic != SNAP_MAGIC)
+		return MINI_READ_ERROR;
+	if (h->version != SNAP_VERSION)
+		return MINI_UNSUPPORTED;
+
+	const size_t group_slots = (size_t)h->group_mask + 1;
+	if (h->size != size || image[size - 1] != '\0' || h->group_count < 1 || group_slots & h->group_mask ||
+	    h->groups != sizeof(snap_header_t) ||
+	    h->group_slots != h->groups + (size_t)h->group_count * sizeof(snap_group_t) ||
+	    h->values != h->group_slots + group_slots * sizeof(snap_slot_t) ||
+	    h->value_slots != h->values + (size_t)h->value_count * sizeof(snap_value_t) || h->value_slots > size)
+		return MINI_READ_ERROR;
+	return MINI_OK;
+}
+
+/* Slot indices point at most to count entries and leave a slot empty,
+ * which ends every probe */
+static int snap_check_slots(const snap_slot_t *slots, size_t slot_count, uint32_t count)
+{
+	size_t used = 0;
+	for (size_t i = 0; i < slot_count; i++) {
+		if (slots[i].index > count)
+			return 0;
+		used += slots[i].index != 0;
+	}
+	return used < slot_count;
+}
+
+/* Every offset and index read by the lookups has to stay inside the image,
+ * once checked the getters can trust the file like one of their own */
+static int snap_check_entries(const char *image, size_t size)
+{
+	const snap_header_t *h = (const snap_header_t *)image;
+	const snap_group_t *groups = (const snap_group_t *)(image + h->groups);
+	const snap_value_t *values = (const snap_value_t *)(image + h->values);
+	const size_t slot_count = (size - h->value_slots) / sizeof(snap_slot_t);
+	const snap_slot_t *value_slots = (const snap_slot_t *)(image + h->value_slots);
+
+	if (!snap_check_slots((const snap_slot_t *)(image + h->group_slots), (size_t)h->group_mask + 1, h->group_count))
+		return MINI_READ_ERROR;
+
+	for (uint32_t i = 0; i < h->group_count; i++) {
+		const snap_group_t *g = &groups[i];
+		const size_t slots = (size_t)g->mask + 1;
+		if ((i > 0 && g->id >= size) || (size_t)g->first + g->count > h->value_count || slots & g->mask ||
+		    g->slots > slot_count || slots > slot_count - g->slots ||
+		    !snap_check_slots(value_slots + g->slots, slots, g->count))
+			return MINI_READ_ERROR;
+	}
+
+	for (uint32_t i = 0; i < h->value_count; i++) {
+		if (values[i].id >= size || values[i].val >= size)
+			return MINI_READ_ERROR;
+	}
+	return MINI_OK;
+}
+
+int mini_save_binary(const mini_t *mini, const char *path, int flags)
+{
+	if (!mini)
+		return MINI_INVALID_ARG;
+	if (!path || strlen(path) < 1)
+		return MINI_INVALID_PATH;
+	if (!snap_little_endian())
+		return MINI_UNSUPPORTED;
+
+	size_t size;
+	char *image = snap_build(mini, &size);
+	if (!image)
+		return MINI_OUT_OF_MEMORY;
+
+	/* Readers may have the old file mapped, rewriting it in place would
+	 * change the bytes under them */
+	const int result = write_file(path, image, size, flags | MINI_FLAGS_ATOMIC);
+	mem_free(image);
+	return result;
+}
+
+mini_snapshot_t *mini_load_binary(const char *path, int *err)
+{
+	if (!snap_little_endian()) {
+		if (err)
+			*err = MINI_UNSUPPORTED;
+		return NULL;
+	}
+
+	char *map;
+	size_t size;
+	int result = map_file(path, &map, &size, 0);
+
+	if (result == MINI_OK)
+		result = snap_check(map, size);
+	if (result == MINI_OK)
+		result = snap_check_entries(map, size);
+	if (result != MINI_OK) {
+		if (map)
+			unmap_file(map, size);
+		if (err)
+			*err = result;
+		return NULL;
+	}
+
+	mini_snapshot_t *snap = mem_alloc(sizeof(mini_snapshot_t));
+	snap->refs = 1;
+	snap->image = map;
+	snap->map = map;
+	snap->map_size = size;
+	return snap;
+}
+
+mini_t *mini_thaw(const mini_snapshot_t *snap)
+{
+	if (!snap)
+		return NULL;
+
+	const char *image = snap->image;
+	const snap_header_t *h = (const snap_header_t *)image;
+	const snap_group_t *groups = (const snap_group_t *)(image + h->groups);
+	const snap_value_t *values = (const snap_value_t *)(image + h->values);
+	mini_t *mini = mini_create(NULL);
+
+	for (uint32_t i = 0; i < h->group_count; i++) {
+		mini_group_t *grp = i ? create_group(mini, image + groups[i].id) : mini->head;
+		for (uint32_t j = groups[i].first; j < groups[i].first + groups[i].count; j++)
+			add_value(mini, grp, image + values[j].id, image + values[j].val);
+	}
+	return mini;
 }
@@ -42,10 +42,14 @@ extern "C" {
 
 #include <stdio.h>
 
+/* Size of the blocks files are read in, the buffer grows for longer lines */
 #ifndef MINI_CHUNK_SIZE
-#define MINI_CHUNK_SIZE 1024
+#define MINI_CHUNK_SIZE (64 * 1024)
 #endif
 
+/* Buffer size needed by mini_format_int/mini_format_double */
+#define MINI_NUMBER_SIZE 32
+
 enum mini_result {
 	MINI_OK,
 	MINI_INVALID_ARG,
@@ -59,6 +63,10 @@ enum mini_result {
 	MINI_ACCESS_DENIED,
 	MINI_READ_ERROR,
 	MINI_CONVERSION_ERROR,
+	MINI_ABORTED,
+	MINI_WRITE_ERROR,
+	MINI_OUT_OF_MEMORY,
+	MINI_UNSUPPORTED,
 	/* Flag errors, will occur independently of the above errors */
 	MINI_INVALID_GROUP = 1 << 4,
 	MINI_UNKNOWN
@@ -67,13 +75,43 @@ enum mini_result {
 enum mini_flags {
 	MINI_FLAGS_NONE = 0,
 	MINI_FLAGS_SKIP_EMPTY_GROUPS = 1 << 0,
+	/* mini_save: write a temporary file next to the target and rename it
+	 * over the target, so a crash never leaves a half written file */
+	MINI_FLAGS_ATOMIC = 1 << 1,
+	/* mini_save: flush the file (and with MINI_FLAGS_ATOMIC the directory)
+	 * to disk before returning */
+	MINI_FLAGS_FSYNC = 1 << 2,
+	/* mini_save: write even if nothing changed since the last load/save */
+	MINI_FLAGS_FORCE = 1 << 3,
+	/* mini_batch_commit: save once after applying, always with MINI_FLAGS_ATOMIC,
+	 * the other flags go to mini_save */
+	MINI_FLAGS_SAVE = 1 << 4,
 };
 
+/* Open addressing hash table used to index groups and values by id.
+ * Every node stored in it has its id as the first member */
+typedef struct mini_slot_s {
+	unsigned int hash;
+	void *node;
+} mini_slot_t;
+
+typedef struct mini_table_s {
+	mini_slot_t *slots; /* NULL until the first insert                 */
+	size_t mask;        /* Slot count - 1, always a power of two       */
+	size_t count;
+	void **sorted;      /* Nodes ordered by id, NULL until iterated    */
+	size_t sorted_size;
+	int sorted_stale;   /* Changed since sorted was built              */
+} mini_table_t;
+
 typedef struct mini_value_s {
 	char *id;                  /* The id of this item                  */
 	char *val;                 /* The value for this item              */
 	struct mini_value_s *next; /* The next value in this group         */
 	struct mini_value_s *prev;
+	int cached;                /* Which of the conversions are valid   */
+	long long int_val;         /* val parsed by mini_get_int           */
+	double double_val;         /* val parsed by mini_get_double        */
 } mini_value_t;
 
 typedef struct mini_group_s {
@@ -82,16 +120,116 @@ typedef struct mini_group_s {
 	struct mini_group_s *prev;
 	mini_value_t *head;        /* The first value for this group       */
 	mini_value_t *tail;
+	mini_table_t values;       /* Index of all values in this group    */
+	struct mini_block_s *block; /* Values packed by mini_pack          */
 } mini_group_t;
 
+/* Counters kept with MINI_ENABLE_STATS, see mini_get_stats */
+typedef struct mini_stats_s {
+	unsigned long long lookups;      /* Value lookups by the get/set/delete methods */
+	unsigned long long hits;
+	unsigned long long group_misses; /* Lookups that ended in MINI_GROUP_NOT_FOUND  */
+	unsigned long long value_misses; /* Lookups that ended in MINI_VALUE_NOT_FOUND  */
+	unsigned long long group_probes; /* Index slots looked at to find groups        */
+	unsigned long long value_probes; /* Index slots looked at to find values        */
+	unsigned long long allocations;  /* Nodes, strings and indices currently held   */
+	unsigned long long bytes;        /* Same as mini_memory_usage                   */
+	unsigned long long load_ns;      /* Time spent parsing                          */
+	unsigned long long save_ns;      /* Time spent in mini_save/mini_savef          */
+} mini_stats_t;
+
 typedef struct mini_s {
 	char *path;
 	mini_group_t *head;
 	mini_group_t *tail;
+	mini_table_t groups;       /* Index of all groups except the root  */
+	mini_table_t atoms;        /* Value ids, shared by equal ids        */
+	struct mini_arena_s *arena; /* Backing memory in arena mode        */
+	char *map;                 /* File mapping from mini_load_mmap     */
+	size_t map_size;
+	unsigned long long generation; /* Bumped when anything is added/removed */
+	unsigned long long instance;   /* Unique for every mini_t of the process */
+	int dirty;                 /* Changed since the last load/save     */
+	char *synced_path;         /* Copy of the path last loaded/saved   */
+	struct mini_journal_s *journal; /* See mini_journal_open           */
+	struct mini_save_state_s *save_state; /* See mini_save_async       */
+	mini_stats_t *stats;       /* NULL without MINI_ENABLE_STATS       */
+	size_t memory;             /* Bytes held outside of the arena      */
 } mini_t;
 
+/* Pre-resolved lookup of one value, see mini_resolve */
+typedef struct mini_key_s {
+	const char *group;
+	const char *id;
+	unsigned int group_hash;
+	unsigned int hash;
+	mini_t *mini;                  /* Instance the key was resolved in  */
+	unsigned long long instance;   /* mini->instance at last resolve    */
+	mini_value_t *value;           /* Cached node, NULL if not found    */
+	int result;                    /* Error code of the last resolve    */
+	unsigned long long generation; /* mini->generation at last resolve  */
+} mini_key_t;
+
 EXPORT mini_t *mini_create(const char *path);
 
+/* Arena mode: all groups, values and strings are allocated from large
+ * chunks owned by the mini_t, which mini_free releases in one go.
+ * Use this for large files which are mostly read */
+EXPORT mini_t *mini_create_arena(const char *path);
+EXPORT mini_t *mini_load_arena_ex(const char *path, int *err);
+EXPORT mini_t *mini_loadf_arena_ex(FILE *f, int *err);
+
+/* Maps the file privately and parses it in place, ids and values point into
+ * the mapping until they are changed. The mapping stays alive until mini_free.
+ * Truncating the file drops the mapped pages even though they are private,
+ * so while the mini_t lives the file may only be replaced by renaming a new
+ * file over it (as MINI_FLAGS_ATOMIC does), never rewritten in place.
+ * mini_save and mini_save_async of such a mini_t always write atomically.
+ * The returned mini_t uses arena mode. On Windows the file is read into
+ * a buffer instead of being mapped */
+EXPORT mini_t *mini_load_mmap(const char *path, int *err);
+
+/* Splits the file at group headers and parses the pieces on up to nthreads
+ * threads. The result is the same as with mini_load */
+EXPORT mini_t *mini_load_parallel(const char *path, int nthreads, int *err);
+
+/* Packs the values of every group into one block per group, nodes in file
+ * order followed by their value strings, so walking a group or saving reads
+ * memory front to back. Values added later are allocated as usual, deletes
+ * and changes stay O(1) and the space they free is reclaimed by the next
+ * pack. Works in every mode, call it after loading or larger changes.
+ * Moves the nodes, so it counts as a change for key handles and iterators */
+EXPORT int mini_pack(mini_t *mini);
+
+/* Hot reload: watches path on a background thread and calls fn with a newly
+ * loaded mini_t (owned by fn) whenever the file was written and closed or
+ * replaced with different contents. Touching the file or rewriting the same
+ * contents doesn't reload. The mini_t is loaded like mini_load does, so it
+ * doesn't depend on the file anymore, and it is complete before fn sees it.
+ * Pass it through mini_freeze and mini_shared_publish to swap it in for
+ * readers on other threads. Changes appended to the journal (see
+ * mini_journal_open) reload as well. Uses inotify on Linux and change
+ * notifications on Windows, elsewhere the file is checked once a second.
+ * Don't call mini_unwatch from fn */
+typedef void (*mini_watch_fn)(mini_t *mini, void *user);
+typedef struct mini_watch_s mini_watch_t;
+
+EXPORT mini_watch_t *mini_watch(const char *path, mini_watch_fn fn, void *user, int *err);
+EXPORT void mini_unwatch(mini_watch_t *watch);
+
+/* Replaces malloc/realloc/free for everything the library allocates, user
+ * is passed to every call. Set it before creating or loading anything,
+ * memory has to be freed by the allocator that allocated it. Passing NULL
+ * for any function restores the defaults. With a custom allocator a path
+ * assigned to mini->path by hand has to be allocated with it as well.
+ * Strings returned by mini_utf8_to_wide_char and mini_utf8_from_wide_char
+ * still come from malloc */
+typedef void *(*mini_malloc_fn)(size_t size, void *user);
+typedef void *(*mini_realloc_fn)(void *ptr, size_t size, void *user);
+typedef void (*mini_free_fn)(void *ptr, void *user);
+
+EXPORT void mini_set_allocator(mini_malloc_fn malloc_fn, mini_realloc_fn realloc_fn, mini_free_fn free_fn, void *user);
+
 /* Load from FILE instance, you will have to set path in the returned struct
  * manually otherwise mini_save will not work */
 /* Loading with optional error code, can be NULL,
@@ -129,9 +267,70 @@ static inline mini_t *mini_loadf(FILE *f)
 	return mini_loadf_ex(f, NULL);
 }
 
-EXPORT int mini_save(const mini_t *mini, int flags);
+static inline mini_t *mini_load_arena(const char *path)
+{
+	return mini_load_arena_ex(path, NULL);
+}
+
+/* Streaming parser, reads the file line by line without building a mini_t.
+ * All strings are null terminated and only valid during the callback.
+ * group is NULL for values in the root group. Returning non-zero from a
+ * callback stops parsing and makes mini_parse_stream return MINI_ABORTED */
+typedef struct mini_callbacks_s {
+	int (*on_group)(const char *group, size_t group_len, void *user);
+	int (*on_value)(const char *group, const char *id, size_t id_len, const char *val, size_t val_len, void *user);
+} mini_callbacks_t;
+
+EXPORT int mini_parse_stream(FILE *f, const mini_callbacks_t *cb, void *user);
+
+/* Skips writing if nothing was changed through the set/delete methods
+ * since the file was loaded from or saved to mini->path */
+EXPORT int mini_save(mini_t *mini, int flags);
 EXPORT int mini_savef(const mini_t *mini, FILE *f, int flags);
 
+/* Saves on a thread owned by the library. The tree is serialized into a
+ * buffer before this returns, so mini can be changed or freed right away
+ * while the file is written in the background. A save of the same path
+ * which is still waiting takes the newer contents, so it is written once
+ * and every on_done of it is called with the result of that write.
+ * on_done can be NULL, it runs on the save thread, or right here if there
+ * is nothing to write. The instance counts as saved once the write
+ * succeeded and nothing changed since the call, which the next mini_save
+ * or mini_save_async picks up, dirty stays 2 until then. mini_save waits
+ * for a queued save of the instance first, so it is never overwritten by
+ * older contents. A successful write removes path.journal like mini_save
+ * does. Not available while a journal is open. mini_save_async_flush
+ * waits for all queued saves, it must not be called from on_done */
+typedef void (*mini_save_fn)(int result, void *user);
+
+EXPORT int mini_save_async(mini_t *mini, int flags, mini_save_fn on_done, void *user);
+EXPORT void mini_save_async_flush(void);
+
+/* Serializes into a null terminated buffer, which has to be
+ * released with mini_free_buffer. len can be NULL */
+EXPORT int mini_save_to_buffer(const mini_t *mini, int flags, char **buf, size_t *len);
+EXPORT void mini_free_buffer(char *buf);
+
+/* Journal mode: every set/delete appends a small record to path.journal
+ * instead of rewriting the whole file. Loading from a path replays the
+ * journal on top of the file, mini_compact (or any mini_save) writes the
+ * file and empties the journal. Opening the journal compacts right away
+ * if the file doesn't match the tree yet. Once the journal reaches
+ * compact_size bytes it is compacted automatically, 0 disables this.
+ * flags are used for compacting, with MINI_FLAGS_FSYNC every record is
+ * flushed to disk. mini_free closes the journal */
+EXPORT int mini_journal_open(mini_t *mini, int flags, size_t compact_size);
+EXPORT int mini_compact(mini_t *mini);
+EXPORT void mini_journal_close(mini_t *mini);
+
+/* Returns the counters of mini if the library was built with
+ * MINI_ENABLE_STATS (cmake -DENABLE_STATS=ON), all zero otherwise */
+EXPORT mini_stats_t mini_get_stats(const mini_t *mini);
+
+/* Bytes currently held by mini: the struct, all nodes, strings and indices
+ * or the arena chunks. Not counted is the file mapping of mini_load_mmap */
+EXPORT size_t mini_memory_usage(const mini_t *mini);
+
 EXPORT void mini_free(mini_t *mini);
 
 EXPORT int mini_value_exists(mini_t *mini, const char *group, const char *id);
@@ -162,6 +361,17 @@ EXPORT double mini_get_double_ex(mini_t *mini, const char *group, const char *id
 #define mini_get_bool(m, g, i, v) mini_get_int(m, g, i, v)
 #define mini_get_bool_ex(m, g, i, v, e) mini_get_int_ex(m, g, i, v, e)
 
+/* Key handles, for values which are read very often.
+ * mini_resolve hashes group and id once and caches the value node. The
+ * getters only look the value up again when values or groups were added
+ * or removed in the meantime, so deleted values are never returned.
+ * The key keeps pointers to group and id, they have to stay valid
+ * for as long as the key is used (e.g. string literals) */
+EXPORT mini_key_t mini_resolve(mini_t *mini, const char *group, const char *id);
+EXPORT const char *mini_get_string_k(mini_t *mini, mini_key_t *key, const char *fallback, int *err);
+EXPORT long long mini_get_int_k(mini_t *mini, mini_key_t *key, long long fallback, int *err);
+EXPORT double mini_get_double_k(mini_t *mini, mini_key_t *key, double fallback, int *err);
+
 static inline const char *mini_get_string(mini_t *mini, const char *group, const char *id, const char *fallback)
 {
 	return mini_get_string_ex(mini, group, id, fallback, NULL);
@@ -177,6 +387,166 @@ static inline double mini_get_double(mini_t *mini, const char *group, const char
 	return mini_get_double_ex(mini, group, id, fallback, NULL);
 }
 
+/* Batched updates, which are applied all at once or not at all.
+ * The operations are only recorded (with copies of the strings) until
+ * mini_batch_commit, which sorts them, looks up every group and value
+ * once and applies the last operation for each value. If a delete would
+ * fail nothing is applied and its error is returned. With a journal the
+ * records of all changes are appended with one write (and one flush),
+ * otherwise MINI_FLAGS_SAVE saves the file once. Changes are rolled back
+ * if that fails. Commit and abort free the batch */
+typedef struct mini_batch_s mini_batch_t;
+
+EXPORT mini_batch_t *mini_batch_begin(mini_t *mini);
+EXPORT int mini_batch_set(mini_batch_t *batch, const char *group, const char *id, const char *val);
+EXPORT int mini_batch_delete(mini_batch_t *batch, const char *group, const char *id);
+EXPORT int mini_batch_commit(mini_batch_t *batch, int flags);
+EXPORT void mini_batch_abort(mini_batch_t *batch);
+
+/* Immutable snapshots: mini_freeze copies a mini_t into one compact
+ * read-only block, which any number of threads can read at the same time
+ * without locking. Strings returned by the getters stay valid until the
+ * snapshot is released. Snapshots are reference counted, mini_freeze
+ * returns the first reference */
+typedef struct mini_snapshot_s mini_snapshot_t;
+
+EXPORT mini_snapshot_t *mini_freeze(const mini_t *mini);
+EXPORT void mini_snapshot_retain(mini_snapshot_t *snap);
+EXPORT void mini_snapshot_release(mini_snapshot_t *snap);
+
+EXPORT const char *mini_snapshot_get_string_ex(const mini_snapshot_t *snap, const char *group, const char *id,
+                                               const char *fallback, int *err);
+EXPORT long long mini_snapshot_get_int_ex(const mini_snapshot_t *snap, const char *group, const char *id,
+                                          long long fallback, int *err);
+EXPORT double mini_snapshot_get_double_ex(const mini_snapshot_t *snap, const char *group, const char *id,
+                                          double fallback, int *err);
+
+static inline const char *mini_snapshot_get_string(const mini_snapshot_t *snap, const char *group, const char *id,
+                                                   const char *fallback)
+{
+	return mini_snapshot_get_string_ex(snap, group, id, fallback, NULL);
+}
+
+static inline long long mini_snapshot_get_int(const mini_snapshot_t *snap, const char *group, const char *id,
+                                              long long fallback)
+{
+	return mini_snapshot_get_int_ex(snap, group, id, fallback, NULL);
+}
+
+static inline double mini_snapshot_get_double(const mini_snapshot_t *snap, const char *group, const char *id,
+                                              double fallback)
+{
+	return mini_snapshot_get_double_ex(snap, group, id, fallback, NULL);
+}
+
+/* Binary files hold a snapshot as it is in memory, in little endian byte
+ * order with a versioned header. mini_load_binary maps the file and reads
+ * directly from the mapping. Loading checks every entry once, which takes
+ * time linear in the file size, so damaged files fail with MINI_READ_ERROR
+ * instead of being read out of bounds. flags are the same as for
+ * mini_save, except that mini_save_binary always writes a temporary file
+ * and renames it over path. While snapshots of a file are loaded, it may
+ * only be replaced that way, never rewritten in place. mini_thaw turns a
+ * snapshot back into a mini_t, which together with mini_load/mini_save
+ * converts between the text and binary form */
+EXPORT int mini_save_binary(const mini_t *mini, const char *path, int flags);
+EXPORT mini_snapshot_t *mini_load_binary(const char *path, int *err);
+EXPORT mini_t *mini_thaw(const mini_snapshot_t *snap);
+
+/* Holds the current snapshot for readers on other threads.
+ * mini_shared_acquire never blocks, it returns a reference which the
+ * reader releases when done. mini_shared_publish takes over the caller's
+ * reference to snap, swaps it in and drops the old snapshot once no
+ * reader can still be acquiring it. Readers holding the old one keep it
+ * alive until they release it. mini_shared_free must not race readers */
+typedef struct mini_shared_s mini_shared_t;
+
+EXPORT mini_shared_t *mini_shared_create(mini_snapshot_t *snap);
+EXPORT mini_snapshot_t *mini_shared_acquire(mini_shared_t *shared);
+EXPORT void mini_shared_publish(mini_shared_t *shared, mini_snapshot_t *snap);
+EXPORT void mini_shared_free(mini_shared_t *shared);
+
+/* Ordered iteration over the values of a group or the group names, in
+ * byte order of their ids. The first call for a group (or for the groups)
+ * builds a sorted index, adds and removes only mark it stale and the next
+ * call sorts again. Starting on an unchanged index costs O(log n), each
+ * step O(1) without allocating.
+ * mini_iter_prefix yields ids starting with prefix, mini_iter_range those
+ * in [from, to), NULL for either bound means unbounded. The root group
+ * isn't among the groups. Iteration ends early once values or groups are
+ * added or removed, changing existing values is fine.
+ *
+ *     mini_iter_t it = mini_iter_prefix(ini, "plugin", "cache.");
+ *     while (mini_iter_next(&it))
+ *         printf("%s=%s\n", it.id, it.val);
+ */
+typedef struct mini_iter_s {
+	const char *id;  /* Current id or group name           */
+	const char *val; /* Current value, NULL for groups     */
+	mini_t *mini;
+	mini_table_t *table;
+	size_t pos;
+	const char *prefix;
+	size_t prefix_len;
+	const char *to;
+	unsigned long long generation;
+} mini_iter_t;
+
+EXPORT mini_iter_t mini_iter_prefix(mini_t *mini, const char *group, const char *prefix);
+EXPORT mini_iter_t mini_iter_range(mini_t *mini, const char *group, const char *from, const char *to);
+EXPORT mini_iter_t mini_iter_groups(mini_t *mini, const char *prefix);
+EXPORT int mini_iter_next(mini_iter_t *it);
+
+/* Layered lookups over several instances without copying them, e.g.
+ * defaults, a site file and host overrides. layers[0] is the bottom,
+ * the getters return the value from the topmost layer that has it.
+ * The layers aren't owned and have to outlive the overlay, they can
+ * still be changed while it is in use. With cache set every looked up
+ * key of a group some layer has remembers the layer value it resolved to
+ * (or that there was none) until a value or group is added to or removed
+ * from any layer, or the cache outgrows a fixed number of keys.
+ * mini_overlay_flatten copies the effective contents into a new mini_t,
+ * groups and values are ordered as in the topmost layer having them */
+typedef struct mini_overlay_s mini_overlay_t;
+
+EXPORT mini_overlay_t *mini_overlay_create(mini_t *const *layers, int count, int cache);
+EXPORT void mini_overlay_free(mini_overlay_t *overlay);
+EXPORT mini_t *mini_overlay_flatten(const mini_overlay_t *overlay);
+
+EXPORT const char *mini_overlay_get_string_ex(mini_overlay_t *overlay, const char *group, const char *id,
+                                              const char *fallback, int *err);
+EXPORT long long mini_overlay_get_int_ex(mini_overlay_t *overlay, const char *group, const char *id,
+                                         long long fallback, int *err);
+EXPORT double mini_overlay_get_double_ex(mini_overlay_t *overlay, const char *group, const char *id, double fallback,
+                                         int *err);
+
+static inline const char *mini_overlay_get_string(mini_overlay_t *overlay, const char *group, const char *id,
+                                                  const char *fallback)
+{
+	return mini_overlay_get_string_ex(overlay, group, id, fallback, NULL);
+}
+
+static inline long long mini_overlay_get_int(mini_overlay_t *overlay, const char *group, const char *id,
+                                             long long fallback)
+{
+	return mini_overlay_get_int_ex(overlay, group, id, fallback, NULL);
+}
+
+static inline double mini_overlay_get_double(mini_overlay_t *overlay, const char *group, const char *id,
+                                             double fallback)
+{
+	return mini_overlay_get_double_ex(overlay, group, id, fallback, NULL);
+}
+
+/* Locale independent number conversion as used by the set/get methods.
+ * Doubles are written with as few digits as possible while still reading
+ * back to exactly the same value, e.g. 0.1 -> "0.1", 3.0 -> "3.0", 1e100 -> "1e100".
+ * buf has to hold at least MINI_NUMBER_SIZE bytes, returns the string length */
+EXPORT int mini_format_int(char *buf, long long val);
+EXPORT int mini_format_double(char *buf, double val);
+/* Like strtod, but always with '.' as the decimal point */
+EXPORT double mini_parse_double(const char *str, char **end);
+
 #ifdef __cplusplus
 }
 #endif